@@ -2,6 +2,8 @@
 
 #include "VkTypes.h"
 #include "CommandUtil.h"
+#include "UploadEngine.h"
+#include "MemoryAllocator.h"
 #include <functional>
 
 #define RETURN_IF_ERROR(expr)   \
@@ -10,6 +12,25 @@ if (outResult != VK_SUCCESS) {  \
     return;                     \
 }
 
+// Typed view of a buffer's persistent mapping, valid as long as the buffer
+template <typename Data>
+struct MappedSpan {
+    Data* data;
+    size_t size;
+
+    Data* begin() {
+        return data;
+    }
+
+    Data* end() {
+        return data + size;
+    }
+
+    Data& operator[](size_t index) {
+        return data[index];
+    }
+};
+
 template <typename Data>
 class Buffer {
 public:
@@ -18,48 +39,62 @@ public:
     }
     
     VkDeviceMemory getMemory() {
-        return **memory_;
+        return memory_->getMemory();
+    }
+    
+    VkDeviceSize getMemoryOffset() {
+        return memory_->getOffset();
     }
     
     VkDeviceSize getStride() {
         return sizeof(Data);
     }
+
+    size_t getNumElements() {
+        return numElements_;
+    }
+
+    // Whether the buffer ended up in memory the host can write
+    bool isHostVisible() {
+        return memory_->getMappedData() != nullptr;
+    }
     
     static VkResult create(std::unique_ptr<Buffer>& outBuffer,
                            size_t numElements,
                            VkBufferUsageFlags usage,
                            VkMemoryPropertyFlags properties,
                            VkDevice device,
-                           VkPhysicalDevice physicalDevice) {
+                           MemoryAllocator& allocator,
+                           VkMemoryPropertyFlags preferredProperties = 0) {
         VkResult result;
         
-        outBuffer = std::make_unique<Buffer<Data>>(numElements, usage, properties, device, physicalDevice, result);
+        outBuffer = std::make_unique<Buffer<Data>>(numElements, usage, properties, device, allocator, preferredProperties, result);
         
         return result;
     }
 
-    static void copyBuffer(VkBuffer src,
-                           VkBuffer dst,
-                           VkDeviceSize size,
-                           VkQueue graphicsQueue,
-                           VkDevice device,
-                           VkCommandPool commandPool) {
-        issueSingleTimeCommand([src, dst, size](VkCommandBuffer commandBuffer){
+    static ImmediateCommands::Token copyBuffer(VkBuffer src,
+                                               VkBuffer dst,
+                                               VkDeviceSize size,
+                                               ImmediateCommands& immediateCommands) {
+        return immediateCommands.record([src, dst, size](VkCommandBuffer commandBuffer){
             VkBufferCopy copyRegion{};
             copyRegion.srcOffset = 0;
             copyRegion.dstOffset = 0;
             copyRegion.size = size;
             vkCmdCopyBuffer(commandBuffer, src, dst, 1 /*regionCount*/, &copyRegion);
-        }, graphicsQueue, device, commandPool);
+        });
     }
+    // When device local memory is host visible (resizable BAR, integrated GPUs) the data is written in place.
+    // Otherwise the copy is only recorded on the upload engine, and the buffer
+    // can't be used until the engine's next flush has completed.
     static void createAndInitialize(std::unique_ptr<Buffer<Data>>& buffer,
                                     const std::vector<Data>& data,
                                     VkBufferUsageFlags usage,
                                     VkDevice device,
-                                    VkPhysicalDevice physicalDevice,
-                                    VkQueue graphicsQueue,
-                                    VkCommandPool commandPool) {
-        createAndInitialize(buffer, data, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, device, physicalDevice, graphicsQueue, commandPool);
+                                    MemoryAllocator& allocator,
+                                    UploadEngine& uploadEngine) {
+        createAndInitialize(buffer, data, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, device, allocator, uploadEngine);
     }
 
     static void createAndInitialize(std::unique_ptr<Buffer<Data>>& buffer,
@@ -67,46 +102,40 @@ public:
                                     VkBufferUsageFlags usage,
                                     VkMemoryPropertyFlags memFlags,
                                     VkDevice device,
-                                    VkPhysicalDevice physicalDevice,
-                                    VkQueue graphicsQueue,
-                                    VkCommandPool commandPool) {
+                                    MemoryAllocator& allocator,
+                                    UploadEngine& uploadEngine) {
         size_t bufferSize = sizeof(Data) * data.size();
         
-        std::unique_ptr<Buffer<Data>> stagingBuffer;
-        VK_SUCCESS_OR_THROW(Buffer<Data>::create(stagingBuffer,
-                                                   data.size(),
-                                                   VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                                                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                                                   device,
-                                                   physicalDevice),
-                            "Failed to create staging buffer");
-        
-        stagingBuffer->mapAndExecute(0, bufferSize, [bufferSize, &data] (void* mappedData){
-            memcpy(mappedData, data.data(), bufferSize);
-        });
-        
+        VkMemoryPropertyFlags preferredFlags = 0;
+        if (allocator.supportsDirectDeviceWrites()) {
+            preferredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+        }
         VK_SUCCESS_OR_THROW(Buffer<Data>::create(buffer,
                                                  data.size(),
                                                  VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage,
                                                  memFlags,
                                                  device,
-                                                 physicalDevice),
+                                                 allocator,
+                                                 preferredFlags),
                             "Failed to create gpu buffer");
         
-        copyBuffer(stagingBuffer->getBuffer(),
-                   buffer->getBuffer(),
-                   bufferSize,
-                   graphicsQueue,
-                   device,
-                   commandPool);
+        // Host writes are visible to any queue submission that follows, so there is nothing to wait for
+        if (buffer->isHostVisible()) {
+            buffer->mapAndExecute(0, bufferSize, [&data, bufferSize](void* mappedData){
+                memcpy(mappedData, data.data(), bufferSize);
+            });
+            return;
+        }
+        uploadEngine.uploadToBuffer(data.data(), bufferSize, buffer->getBuffer());
     }
 
     Buffer(size_t numElements,
            VkBufferUsageFlags usage,
            VkMemoryPropertyFlags properties,
            VkDevice device,
-           VkPhysicalDevice physicalDevice,
-           VkResult& outResult) : device_(device) {
+           MemoryAllocator& allocator,
+           VkMemoryPropertyFlags preferredProperties,
+           VkResult& outResult) : device_(device), numElements_(numElements) {
         VkBufferCreateInfo bufferInfo{};
         bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
         bufferInfo.size = sizeof(Data) * numElements;
@@ -118,38 +147,59 @@ public:
         VkMemoryRequirements memoryRequirements;
         vkGetBufferMemoryRequirements(device_, **buffer_, &memoryRequirements);
 
-        RETURN_IF_ERROR(VulkanMemory::createFromRequirements(memory_,
-                                                             device_,
-                                                             physicalDevice,
-                                                             properties,
-                                                             memoryRequirements))
+        RETURN_IF_ERROR(allocator.allocate(memory_, memoryRequirements, properties, BUFFER_MEMORY, false /* optimalImage */, preferredProperties))
         
-        vkBindBufferMemory(device_, **buffer_, **memory_, 0);
+        vkBindBufferMemory(device_, **buffer_, memory_->getMemory(), memory_->getOffset());
     }
     
+    // Host visible memory is mapped by the allocator for its whole life, so there is nothing to map here.
+    // Writes to non-coherent memory are flushed once op returns.
     void mapAndExecute(VkDeviceSize offset,
                        VkDeviceSize size,
                        std::function<void(void*)> op) {
-        void* mappedData;
-        vkMapMemory(device_, **memory_, offset, size, 0, &mappedData);
-        
-        op(mappedData);
-        
-        vkUnmapMemory(device_, **memory_);
+        op(static_cast<char*>(memory_->getMappedData()) + offset);
+        VK_SUCCESS_OR_THROW(flush(offset, size), "Failed to flush buffer memory");
+    }
+
+    // Only valid for host visible buffers
+    MappedSpan<Data> getMappedSpan() {
+        return {reinterpret_cast<Data*>(memory_->getMappedData()), numElements_};
+    }
+
+    // Makes host writes in the byte range visible to the device, a no-op for coherent memory
+    VkResult flush(VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE) {
+        if (memory_->isCoherent()) {
+            return VK_SUCCESS;
+        }
+        VkMappedMemoryRange range = memory_->getMappedRange(offset, size);
+        return vkFlushMappedMemoryRanges(device_, 1, &range);
+    }
+
+    // Makes device writes in the byte range visible to the host, a no-op for coherent memory
+    VkResult invalidate(VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE) {
+        if (memory_->isCoherent()) {
+            return VK_SUCCESS;
+        }
+        VkMappedMemoryRange range = memory_->getMappedRange(offset, size);
+        return vkInvalidateMappedMemoryRanges(device_, 1, &range);
+    }
+
+    // Queues the byte range so many buffers can be flushed or invalidated with one call
+    void addMappedRange(MappedRangeBatch& batch, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE) {
+        batch.add(*memory_, offset, size);
     }
     
     std::unique_ptr<Data, std::function<void(Data*)>> getPersistentMapping(VkDeviceSize offset, VkDeviceSize size) {
-        void* data;
+        auto* data = reinterpret_cast<Data*>(static_cast<char*>(memory_->getMappedData()) + offset);
         
-        vkMapMemory(device_, **memory_, offset, size, 0, &data);
-        
-        return std::unique_ptr<Data, std::function<void(Data*)>>((Data*) data, [device = device_, memory = **memory_](Data*){
-            vkUnmapMemory(device, memory);
-        });
+        // The mapping lives as long as the buffer
+        return std::unique_ptr<Data, std::function<void(Data*)>>(data, [](Data*){});
     }
     
 private:
     VkDevice device_;
+    size_t numElements_;
+    // Declared first so the range outlives the buffer bound to it
+    std::unique_ptr<MemoryAllocation> memory_;
     std::unique_ptr<VulkanBuffer> buffer_;
-    std::unique_ptr<VulkanMemory> memory_;
 };
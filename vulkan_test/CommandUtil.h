@@ -1,43 +1,120 @@
 #pragma once
 
-#include <vulkan/vulkan.h>
-
-void issueSingleTimeCommand(std::function<void(VkCommandBuffer)> op,
-                            VkQueue queue,
-                            VkDevice device,
-                            VkCommandPool commandPool);
-
-#ifdef VK_WRAP_UTIL_IMPL
-void issueSingleTimeCommand(std::function<void(VkCommandBuffer)> op,
-                            VkQueue queue,
-                            VkDevice device,
-                            VkCommandPool commandPool) {
-    VkCommandBufferAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.commandPool = commandPool;
-    allocInfo.commandBufferCount = 1;
-    
-    VkCommandBuffer commandBuffer;
-    vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
-    
-    VkCommandBufferBeginInfo beginInfo{};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    
-    vkBeginCommandBuffer(commandBuffer, &beginInfo);
-    
-    op(commandBuffer);
-    
-    vkEndCommandBuffer(commandBuffer);
-    
-    VkSubmitInfo submitInfo{};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
-    
-    vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(queue);
-    
-    vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
-}
-#endif
+#include "VkTypes.h"
+#include "VkUtil.h"
+#include "SyncPool.h"
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+// Collects one-off commands (copies, layout transitions) into a shared command buffer and submits
+// them in batches guarded by a fence, so loading N resources doesn't stall the queue N times.
+// Command buffers and fences of finished batches go back to the sync pool.
+// Not thread safe, commands are expected to come from a single loading thread.
+class ImmediateCommands {
+public:
+    // Completes once the batch the commands went out with has finished on the GPU
+    using Token = uint64_t;
+
+    ImmediateCommands(VkDevice device, SyncPool& syncPool, VkQueue queue, uint32_t queueFamily)
+    : device_(device), syncPool_(syncPool), queue_(queue), queueFamily_(queueFamily) {}
+
+    ~ImmediateCommands() {
+        // Pooled objects can't be handed out again while they are executing
+        for (auto& batch : inFlight_) {
+            vkWaitForFences(device_, 1, batch.fence.get(), VK_TRUE, UINT64_MAX);
+        }
+    }
+
+    ImmediateCommands(const ImmediateCommands&) = delete;
+    ImmediateCommands& operator=(const ImmediateCommands&) = delete;
+
+    // Records op into the pending batch, nothing is submitted until flush()
+    Token record(std::function<void(VkCommandBuffer)> op) {
+        if (!pendingCommands_) {
+            pendingCommands_ = acquireCommandBuffer();
+        }
+        op(*pendingCommands_);
+        return nextToken_;
+    }
+
+    // Submits everything recorded since the last flush.
+    // Returns the token of the last batch if nothing was recorded.
+    Token flush() {
+        if (!pendingCommands_) {
+            return nextToken_ - 1;
+        }
+        VK_SUCCESS_OR_THROW(vkEndCommandBuffer(*pendingCommands_),
+                            "Failed to record immediate commands");
+
+        Batch batch{nextToken_++, std::move(pendingCommands_), syncPool_.acquireFence()};
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = batch.commandBuffer.get();
+        VK_SUCCESS_OR_THROW(vkQueueSubmit(queue_, 1, &submitInfo, *batch.fence),
+                            "Failed to submit immediate commands");
+
+        inFlight_.push_back(std::move(batch));
+        return inFlight_.back().token;
+    }
+
+    bool isComplete(Token token) {
+        retire();
+        return token <= completed_;
+    }
+
+    // Flushes first if the token belongs to the pending batch
+    void wait(Token token) {
+        if (token == nextToken_ && pendingCommands_) {
+            flush();
+        }
+        for (auto& batch : inFlight_) {
+            if (batch.token > token) {
+                break;
+            }
+            vkWaitForFences(device_, 1, batch.fence.get(), VK_TRUE, UINT64_MAX);
+        }
+        retire();
+    }
+
+private:
+    struct Batch {
+        Token token;
+        CommandBufferLease commandBuffer;
+        FenceLease fence;
+    };
+
+    CommandBufferLease acquireCommandBuffer() {
+        CommandBufferLease commandBuffer = syncPool_.acquireCommandBuffer(queueFamily_);
+
+        // Beginning implicitly resets a recycled command buffer
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        VK_SUCCESS_OR_THROW(vkBeginCommandBuffer(*commandBuffer, &beginInfo),
+                            "Failed to begin immediate command buffer");
+        return commandBuffer;
+    }
+
+    // Gives every batch at the front of the queue whose fence has signaled back to the pool
+    void retire() {
+        while (!inFlight_.empty() && vkGetFenceStatus(device_, *inFlight_.front().fence) == VK_SUCCESS) {
+            completed_ = inFlight_.front().token;
+            inFlight_.pop_front();
+        }
+    }
+
+private:
+    VkDevice device_;
+    SyncPool& syncPool_;
+    VkQueue queue_;
+    uint32_t queueFamily_;
+
+    CommandBufferLease pendingCommands_;
+    std::deque<Batch> inFlight_;
+    Token nextToken_ = 1;
+    Token completed_ = 0;
+};
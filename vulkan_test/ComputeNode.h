@@ -1,75 +1,39 @@
 #pragma once
 
-#include "RenderGraph.h"
+#include "RecordedNode.h"
 #include "Renderable.h"
 #include "VkUtil.h"
 
 template<uint MAX_FRAMES>
-class ComputeNode : public RenderNode<MAX_FRAMES> {
+class ComputeNode : public RecordedNode<MAX_FRAMES> {
 public:
     ComputeNode<MAX_FRAMES>(std::unique_ptr<ComputeMaterial<MAX_FRAMES>>&& computePass,
                             VkDevice device,
                             VkQueue computeQueue,
-                            std::array<VkCommandBuffer, MAX_FRAMES> commandBuffers)
-    : RenderNode<MAX_FRAMES>(device),
-    computeQueue_(computeQueue),
-    commandBuffers_(commandBuffers),
+                            uint32_t computeQueueFamily)
+    : RecordedNode<MAX_FRAMES>(device, computeQueue, computeQueueFamily, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT),
     computePass_(std::move(computePass)) {}
     
-    NodeDevice getDeviceType() override {
-        return NodeDevice::GPU;
+protected:
+    void prepareFrame(const RenderEvalContext& ctx) override {
+        // Update material
+        computePass_->prepareFrame(ctx.frameIndex, ctx.swapchainExtent);
     }
     
-    void submit(RenderEvalContext& ctx) override {
-        // Update material
-        computePass_->update(ctx.frameIndex, ctx.swapchainExtent);
-        
-        // Start command buffer
-        auto& commandBuffer = commandBuffers_[ctx.frameIndex];
-        VK_SUCCESS_OR_THROW(vkResetCommandBuffer(commandBuffer, 0),
-                            "Failed to reset compute command buffer");
-        
-        VkCommandBufferBeginInfo beginInfo{};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        VK_SUCCESS_OR_THROW(vkBeginCommandBuffer(commandBuffer, &beginInfo),
-                            "Failed to begin compute commmand buffer");
-
+    void record(const RenderEvalContext& ctx, VkCommandBuffer commandBuffer) override {
         // Bind pipeline & descriptor sets
         vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePass_->getPipeline());
         vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
                                 computePass_->getPipelineLayout(),
                                 0, 1,
                                 computePass_->getDescriptorSet(ctx.frameIndex),
-                                0, 0);
+                                static_cast<uint32_t>(computePass_->getDynamicOffsets(ctx.frameIndex).size()),
+                                computePass_->getDynamicOffsets(ctx.frameIndex).data());
         // Dispatch workgroups
         auto dispatchSize = computePass_->getDispatchDimensions();
         vkCmdDispatch(commandBuffer, dispatchSize.x, dispatchSize.y, dispatchSize.z);
-        
-        // End command buffer
-        vkEndCommandBuffer(commandBuffer);
-        
-        // Submit Work
-        VkSubmitInfo submitInfo{};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffer;
-        
-        auto& waitSemaphores = RenderNode<MAX_FRAMES>::waitSemaphores_[ctx.frameIndex];
-        submitInfo.waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size());
-        submitInfo.pWaitSemaphores = waitSemaphores.data();
-        std::array<VkSemaphore,1> signalSemaphores = {**RenderNode<MAX_FRAMES>::signalSemaphores_[ctx.frameIndex]};
-        submitInfo.signalSemaphoreCount = static_cast<uint32_t>(signalSemaphores.size());
-        submitInfo.pSignalSemaphores = signalSemaphores.data();
-        
-        VK_SUCCESS_OR_THROW(vkQueueSubmit(computeQueue_,
-                                          1,
-                                          &submitInfo,
-                                          **RenderNode<MAX_FRAMES>::signalFences_[ctx.frameIndex]),
-                            "Failed to submit compute");
     }
     
 protected:
-    VkQueue computeQueue_;
-    std::array<VkCommandBuffer, MAX_FRAMES> commandBuffers_;
     std::unique_ptr<ComputeMaterial<MAX_FRAMES>> computePass_;
 };
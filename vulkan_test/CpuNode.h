@@ -0,0 +1,109 @@
+#pragma once
+
+#include "RenderGraph.h"
+#include "ThreadPool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+
+// Runs an arbitrary job (animation, culling, uniform updates...) on the graph's thread pool.
+// The job starts once the graph reaches this node and every CPU parent has finished,
+// GPU children are only held back until the job completes.
+// A job that throws still completes, its exception is rethrown to whoever waits on it.
+template<uint MAX_FRAMES>
+class CpuNode : public RenderNode<MAX_FRAMES> {
+public:
+    using Job = std::function<void(uint32_t frameIndex, VkExtent2D swapchainExtent)>;
+    
+    CpuNode<MAX_FRAMES>(VkDevice device, Job job)
+    : RenderNode<MAX_FRAMES>(device), job_(std::move(job)) {}
+    
+    NodeDevice getDeviceType() override {
+        return NodeDevice::CPU;
+    }
+    
+    void submit(RenderEvalContext& ctx) override {
+        swapchainExtents_[ctx.frameIndex] = ctx.swapchainExtent;
+        // Release the graph's hold on this node
+        release(ctx.frameIndex);
+    }
+
+protected:
+    bool supportsCpuEdges() override {
+        return true;
+    }
+    
+    void prepareFrame(const RenderEvalContext& ctx) override {
+        // The job waits on its CPU parents plus the graph reaching it
+        auto& frame = frames_[ctx.frameIndex];
+        {
+            std::lock_guard<std::mutex> lock(frame.mutex);
+            frame.done = false;
+        }
+        frame.pending.store(RenderNode<MAX_FRAMES>::cpuParentCount_ + 1, std::memory_order_relaxed);
+    }
+    
+    void waitForCpuWork(uint32_t frameIndex) override {
+        auto& frame = frames_[frameIndex];
+        std::unique_lock<std::mutex> lock(frame.mutex);
+        frame.finished.wait(lock, [&frame](){ return frame.done; });
+        if (frame.error) {
+            auto error = frame.error;
+            frame.error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    void release(uint32_t frameIndex) {
+        if (frames_[frameIndex].pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            RenderNode<MAX_FRAMES>::threadPool_->submit([this, frameIndex](){ run(frameIndex); });
+        }
+    }
+    
+    void run(uint32_t frameIndex) {
+        // GPU parents signal fences
+        auto& fences = RenderNode<MAX_FRAMES>::waitFences_[frameIndex];
+        if (!fences.empty()) {
+            vkWaitForFences(RenderNode<MAX_FRAMES>::device_,
+                            static_cast<uint32_t>(fences.size()), fences.data(),
+                            VK_TRUE, UINT64_MAX);
+        }
+        
+        std::exception_ptr error;
+        try {
+            job_(frameIndex, swapchainExtents_[frameIndex]);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        
+        auto& frame = frames_[frameIndex];
+        {
+            std::lock_guard<std::mutex> lock(frame.mutex);
+            frame.error = error;
+            frame.done = true;
+        }
+        frame.finished.notify_all();
+        
+        // Children still run so nobody waits on them forever
+        // The graph only wires CPU -> CPU edges between nodes that support them
+        for (auto* child : RenderNode<MAX_FRAMES>::cpuChildren_) {
+            static_cast<CpuNode<MAX_FRAMES>*>(child)->release(frameIndex);
+        }
+    }
+
+private:
+    struct FrameState {
+        std::atomic<uint32_t> pending = 0;
+        std::mutex mutex;
+        std::condition_variable finished;
+        bool done = true;
+        std::exception_ptr error;
+    };
+    
+    Job job_;
+    std::array<FrameState, MAX_FRAMES> frames_;
+    std::array<VkExtent2D, MAX_FRAMES> swapchainExtents_{};
+};
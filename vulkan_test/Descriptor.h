@@ -15,11 +15,25 @@ public:
         return stageFlags_;
     }
     
+    // Bumped whenever a binding changes, so materials know to rewrite their sets
+    uint32_t getGeneration() {
+        return generation_;
+    }
+    
+    // Descriptors can be created before the resource they point to exists
+    bool isBound(const uint32_t frameIndex) {
+        auto* bufferInfo = getBufferInfo(frameIndex);
+        auto* imageInfo = getImageInfo(frameIndex);
+        return bufferInfo ? bufferInfo->buffer != VK_NULL_HANDLE : imageInfo->imageView != VK_NULL_HANDLE;
+    }
+    
     virtual VkDescriptorBufferInfo* getBufferInfo(const uint32_t frameIndex) = 0;
     virtual VkDescriptorImageInfo* getImageInfo(const uint32_t frameIndex) = 0;
 
 protected:
     Descriptor(VkDescriptorType type, VkShaderStageFlags stageFlags): type_(type), stageFlags_(stageFlags) {}
+    
+    uint32_t generation_ = 0;
 private:
     VkDescriptorType type_;
     VkShaderStageFlags stageFlags_;
@@ -49,6 +63,7 @@ public:
     void bindBuffer(VkBuffer buffer, int size, const uint32_t frameIndex = 0) {
         bufferInfos_[frameIndex].buffer = buffer;
         bufferInfos_[frameIndex].range = sizeof(Data) * size;
+        ++generation_;
     }
 private:
     std::array<VkDescriptorBufferInfo, MAX_FRAMES> bufferInfos_;
@@ -77,6 +92,31 @@ public:
 
     void bindBuffer(const uint32_t frameIndex, VkBuffer buffer) {
         bufferInfos_[frameIndex].buffer = buffer;
+        ++generation_;
+    }
+private:
+    std::array<VkDescriptorBufferInfo, MAX_FRAMES> bufferInfos_;
+};
+
+// Descriptor for uniforms living in a shared buffer, the offset is picked when the set is bound
+template<typename Ubo, uint MAX_FRAMES>
+class DynamicUniformBufferDescriptor : public Descriptor {
+public:
+    DynamicUniformBufferDescriptor<Ubo, MAX_FRAMES>(VkBuffer buffer, VkShaderStageFlags stageFlags)
+    : Descriptor(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, stageFlags) {
+        for (uint frameIdx = 0; frameIdx < MAX_FRAMES; ++frameIdx) {
+            bufferInfos_[frameIdx].buffer = buffer;
+            bufferInfos_[frameIdx].offset = 0;
+            bufferInfos_[frameIdx].range = sizeof(Ubo);
+        }
+    }
+
+    VkDescriptorBufferInfo* getBufferInfo(const uint32_t frameIndex) override {
+        return &bufferInfos_.at(frameIndex);
+    }
+
+    VkDescriptorImageInfo* getImageInfo(const uint32_t frameIndex) override {
+        return nullptr;
     }
 private:
     std::array<VkDescriptorBufferInfo, MAX_FRAMES> bufferInfos_;
@@ -95,13 +135,19 @@ public:
     VkDescriptorBufferInfo* getBufferInfo(const uint32_t frameIndex) override {
         return nullptr;
     }
+    
+    void bindImageView(const uint32_t frameIndex, VkImageView imageView) {
+        imageInfos_[frameIndex].imageView = imageView;
+        ++generation_;
+    }
 protected:
     ImageDescriptor<MAX_FRAMES>(VkDescriptorType type,
                                 VkShaderStageFlags stageFlags,
-                                std::array<VkImageView, MAX_FRAMES> imageViews)
+                                std::array<VkImageView, MAX_FRAMES> imageViews,
+                                VkImageLayout imageLayout)
     : Descriptor(type, stageFlags) {
         for (uint frameIdx = 0; frameIdx < MAX_FRAMES; ++frameIdx) {
-            imageInfos_[frameIdx].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            imageInfos_[frameIdx].imageLayout = imageLayout;
             imageInfos_[frameIdx].imageView = imageViews[frameIdx];
         }
     }
@@ -113,9 +159,11 @@ protected:
 template<uint MAX_FRAMES>
 class StorageImageDescriptor : public ImageDescriptor<MAX_FRAMES> {
 public:
+    // Storage images are written in the general layout
     StorageImageDescriptor<MAX_FRAMES>(VkShaderStageFlags stageFlags,
-                                       std::array<VkImageView, MAX_FRAMES> imageViews)
-    : ImageDescriptor<MAX_FRAMES>(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, stageFlags, imageViews) {}
+                                       std::array<VkImageView, MAX_FRAMES> imageViews,
+                                       VkImageLayout imageLayout = VK_IMAGE_LAYOUT_GENERAL)
+    : ImageDescriptor<MAX_FRAMES>(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, stageFlags, imageViews, imageLayout) {}
 };
 
 // Combined Image Sampler Descriptor
@@ -125,7 +173,10 @@ public:
     CombinedImageSamplerDescriptor<MAX_FRAMES>(VkShaderStageFlags stageFlags,
                                                std::array<VkImageView, MAX_FRAMES> imageViews,
                                                VkSampler sampler)
-    : ImageDescriptor<MAX_FRAMES>(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, stageFlags, imageViews) {
+    : ImageDescriptor<MAX_FRAMES>(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                                  stageFlags,
+                                  imageViews,
+                                  VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
         for (uint frameIdx = 0; frameIdx < MAX_FRAMES; ++frameIdx) {
             ImageDescriptor<MAX_FRAMES>::imageInfos_[frameIdx].sampler = sampler;
         }
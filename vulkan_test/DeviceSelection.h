@@ -4,9 +4,18 @@
 #include "QueueFamilyIndices.h"
 #include "SwapChainSupportDetails.h"
 
+#include <algorithm>
+#include <cstring>
+
 bool checkDeviceExtensionSupport(VkPhysicalDevice device);
 VkPhysicalDeviceFeatures getSupportedFeatures(VkPhysicalDevice device);
 bool isDeviceSuitable(VkPhysicalDevice device, VkSurfaceKHR surface);
+uint32_t getInstanceApiVersion();
+uint32_t getApiVersion(VkPhysicalDevice device, uint32_t instanceApiVersion);
+bool checkTimelineSemaphoreSupport(VkPhysicalDevice device, uint32_t instanceApiVersion);
+bool checkDeviceExtensionAvailable(VkPhysicalDevice device, const char* extensionName);
+bool checkMemoryBudgetSupport(VkPhysicalDevice device, uint32_t instanceApiVersion);
+bool checkExternalMemoryHostSupport(VkPhysicalDevice device, uint32_t instanceApiVersion);
 VkPhysicalDevice pickPhysicalDevice(VkInstance instance, VkSurfaceKHR surface);
 
 #ifdef VK_WRAP_UTIL_IMPL
@@ -32,6 +41,69 @@ bool isDeviceSuitable(VkPhysicalDevice device, VkSurfaceKHR surface) {
             && getSupportedFeatures(device).samplerAnisotropy;
 }
 
+// The version to create the instance with, the loader's own capped at 1.2 which is all we use.
+// 1.0 loaders have no vkEnumerateInstanceVersion and fail instance creation for anything newer.
+uint32_t getInstanceApiVersion() {
+    auto enumerateInstanceVersion = reinterpret_cast<PFN_vkEnumerateInstanceVersion>(
+        vkGetInstanceProcAddr(VK_NULL_HANDLE, "vkEnumerateInstanceVersion"));
+    uint32_t version = VK_API_VERSION_1_0;
+    if (!enumerateInstanceVersion || enumerateInstanceVersion(&version) != VK_SUCCESS) {
+        return VK_API_VERSION_1_0;
+    }
+    return std::min(VK_MAKE_VERSION(VK_VERSION_MAJOR(version), VK_VERSION_MINOR(version), 0), VK_API_VERSION_1_2);
+}
+
+// Version the device's core functionality can be used at, capped by the version the instance was created with
+uint32_t getApiVersion(VkPhysicalDevice device, uint32_t instanceApiVersion) {
+    VkPhysicalDeviceProperties properties{};
+    vkGetPhysicalDeviceProperties(device, &properties);
+    return std::min(properties.apiVersion, instanceApiVersion);
+}
+
+bool checkTimelineSemaphoreSupport(VkPhysicalDevice device, uint32_t instanceApiVersion) {
+    // Timeline semaphores are core as of 1.2, older devices and instances are left on binary sync
+    if (getApiVersion(device, instanceApiVersion) < VK_API_VERSION_1_2) {
+        return false;
+    }
+    
+    VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures{};
+    timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+    VkPhysicalDeviceFeatures2 features{};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &timelineFeatures;
+    vkGetPhysicalDeviceFeatures2(device, &features);
+    
+    return timelineFeatures.timelineSemaphore == VK_TRUE;
+}
+
+bool checkDeviceExtensionAvailable(VkPhysicalDevice device, const char* extensionName) {
+    std::vector<VkExtensionProperties> availableExtensions = readVkVector<VkExtensionProperties, VkPhysicalDevice, const char*>(device, vkEnumerateDeviceExtensionProperties);
+    for (const auto& extension : availableExtensions) {
+        if (strcmp(extension.extensionName, extensionName) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool checkMemoryBudgetSupport(VkPhysicalDevice device, uint32_t instanceApiVersion) {
+    // Queried through vkGetPhysicalDeviceMemoryProperties2, which is core as of 1.1
+    if (getApiVersion(device, instanceApiVersion) < VK_API_VERSION_1_1) {
+        return false;
+    }
+    
+    return checkDeviceExtensionAvailable(device, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+}
+
+bool checkExternalMemoryHostSupport(VkPhysicalDevice device, uint32_t instanceApiVersion) {
+    // Builds on VK_KHR_external_memory and vkGetPhysicalDeviceProperties2, which are core as of 1.1
+    if (getApiVersion(device, instanceApiVersion) < VK_API_VERSION_1_1) {
+        return false;
+    }
+    
+    return checkDeviceExtensionAvailable(device, VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+}
+
 // Returns VK_NULL_HANDLE if no suitable device found
 VkPhysicalDevice pickPhysicalDevice(VkInstance instance, VkSurfaceKHR surface) {
     std::vector<VkPhysicalDevice> devices = readVkVector<VkPhysicalDevice, VkInstance>(instance, vkEnumeratePhysicalDevices);
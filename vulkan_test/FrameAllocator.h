@@ -0,0 +1,82 @@
+#pragma once
+
+#include "VkTypes.h"
+#include "Buffer.h"
+#include "MemoryAllocator.h"
+
+#include <mutex>
+
+// Slice of the frame allocator's buffer, only valid until the same frame index comes around again
+struct FrameSlice {
+    void* data;
+    // Offset into the allocator's buffer, usable as a dynamic descriptor offset
+    uint32_t offset;
+};
+
+// One host visible buffer split into a region per frame in flight, handing out aligned slices
+// with a bump pointer. Per-object uniforms written every frame share the buffer and are told
+// apart by dynamic offsets, rather than each material owning a buffer per frame.
+// Slices can also be copied from, to stage small per-frame uploads.
+template<uint MAX_FRAMES>
+class FrameAllocator {
+public:
+    FrameAllocator(VkDevice device,
+                   VkPhysicalDevice physicalDevice,
+                   MemoryAllocator& allocator,
+                   VkDeviceSize frameCapacity = 4 * 1024 * 1024) {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        alignment_ = properties.limits.minUniformBufferOffsetAlignment;
+        frameCapacity_ = (frameCapacity + alignment_ - 1) / alignment_ * alignment_;
+
+        VK_SUCCESS_OR_THROW(Buffer<uint8_t>::create(buffer_,
+                                                    frameCapacity_ * MAX_FRAMES,
+                                                    VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                                                    | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                                    device,
+                                                    allocator,
+                                                    allocator.supportsDirectDeviceWrites() ? VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT : 0),
+                            "Failed to create frame allocator buffer.");
+        mappedData_ = buffer_->getPersistentMapping(0, frameCapacity_ * MAX_FRAMES);
+    }
+
+    VkBuffer getBuffer() {
+        return buffer_->getBuffer();
+    }
+
+    // Only call once the GPU is done with the frame, everything handed out for it is reused
+    void beginFrame(uint32_t frameIndex) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        heads_.at(frameIndex) = 0;
+    }
+
+    // Nodes record on worker threads, so slices can be requested concurrently
+    FrameSlice allocate(uint32_t frameIndex, VkDeviceSize size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        VkDeviceSize offset = heads_.at(frameIndex);
+        if (offset + size > frameCapacity_) {
+            throw std::runtime_error("Frame allocator is out of space.");
+        }
+        heads_[frameIndex] = (offset + size + alignment_ - 1) / alignment_ * alignment_;
+
+        offset += frameCapacity_ * frameIndex;
+        return {mappedData_.get() + offset, static_cast<uint32_t>(offset)};
+    }
+
+    template<typename Data>
+    FrameSlice push(uint32_t frameIndex, const Data& data) {
+        FrameSlice slice = allocate(frameIndex, sizeof(Data));
+        memcpy(slice.data, &data, sizeof(Data));
+        return slice;
+    }
+
+private:
+    std::unique_ptr<Buffer<uint8_t>> buffer_;
+    std::unique_ptr<uint8_t, std::function<void(uint8_t*)>> mappedData_;
+    VkDeviceSize alignment_;
+    VkDeviceSize frameCapacity_;
+
+    std::mutex mutex_;
+    std::array<VkDeviceSize, MAX_FRAMES> heads_{};
+};
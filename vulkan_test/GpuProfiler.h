@@ -0,0 +1,201 @@
+#pragma once
+
+#include "VkTypes.h"
+#include "VkUtil.h"
+
+#include <algorithm>
+#include <cmath>
+#include <optional>
+
+struct NodeTimingStats {
+    double meanMs;
+    double p50Ms;
+    double p99Ms;
+    // Frames the statistics are computed over
+    uint32_t sampleCount;
+};
+
+// Brackets the work of every recorded node with a pair of timestamps.
+// Each frame in flight has its own query pool, which is only read back once the
+// frame comes around again, so results never stall the CPU.
+// The graph waits on every recorded node before reusing a slot, queries that still aren't available
+// are left alone and that node goes unprofiled in the slot until they are.
+template<uint MAX_FRAMES>
+class GpuProfiler {
+public:
+    using NodeHandle = uint32_t;
+    
+    // Rolling window the statistics are computed over
+    static constexpr uint32_t SAMPLE_COUNT = 256;
+
+    GpuProfiler<MAX_FRAMES>(VkDevice device, VkPhysicalDevice physicalDevice)
+    : device_(device) {
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        timestampPeriod_ = properties.limits.timestampPeriod;
+        
+        queueFamilies_ = readVkVectorVoid<VkQueueFamilyProperties, VkPhysicalDevice>(physicalDevice, vkGetPhysicalDeviceQueueFamilyProperties);
+    }
+    
+    // Hands out a pair of queries to every node recording on a queue family that can write timestamps.
+    // queueFamilies is indexed by node, nodes without a value aren't profiled.
+    void assignQueries(const std::vector<std::optional<uint32_t>>& queueFamilies) {
+        queryIndices_.assign(queueFamilies.size(), NO_QUERY);
+        validBitMasks_.assign(queueFamilies.size(), 0);
+        timings_.resize(queueFamilies.size());
+        
+        uint32_t queryCount = 0;
+        for (NodeHandle node = 0; node < queueFamilies.size(); ++node) {
+            if (!queueFamilies[node].has_value()) {
+                continue;
+            }
+            // Queries are reset from the command buffer, which only graphics and compute queues can do
+            auto& family = queueFamilies_.at(queueFamilies[node].value());
+            if (family.timestampValidBits == 0 || !(family.queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+                continue;
+            }
+            queryIndices_[node] = queryCount;
+            validBitMasks_[node] = family.timestampValidBits >= 64 ? UINT64_MAX : (uint64_t(1) << family.timestampValidBits) - 1;
+            queryCount += 2;
+        }
+        
+        // Results recorded before the change can't be attributed anymore,
+        // and the queries they go to may be handed out again
+        bool written = std::any_of(writtenNodes_.begin(), writtenNodes_.end(), [](const auto& nodes){
+            return !nodes.empty();
+        });
+        if (written) {
+            vkDeviceWaitIdle(device_);
+        }
+        for (auto& nodes : writtenNodes_) {
+            nodes.clear();
+        }
+        if (queryCount <= queryCapacity_) {
+            return;
+        }
+        
+        VkQueryPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        poolInfo.queryCount = queryCount;
+        for (auto& pool : queryPools_) {
+            VK_SUCCESS_OR_THROW(VulkanQueryPool::create(pool, device_, poolInfo),
+                                "Failed to create timestamp query pool");
+        }
+        queryCapacity_ = queryCount;
+    }
+    
+    // Folds in the timings of the last frame recorded in this slot that have landed.
+    // Nodes whose queries aren't available yet stay pending until the slot comes around again.
+    void collect(uint32_t frameIndex) {
+        auto& written = writtenNodes_[frameIndex];
+        auto pending = written.begin();
+        for (NodeHandle node : written) {
+            // Start and end timestamps, each followed by its availability
+            std::array<uint64_t, 4> results{};
+            VkResult result = vkGetQueryPoolResults(device_,
+                                                    **queryPools_[frameIndex],
+                                                    queryIndices_[node], 2,
+                                                    sizeof(results), results.data(),
+                                                    2 * sizeof(uint64_t),
+                                                    VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+            if (result == VK_NOT_READY || (result == VK_SUCCESS && (results[1] == 0 || results[3] == 0))) {
+                *pending++ = node;
+                continue;
+            }
+            if (result != VK_SUCCESS) {
+                continue;
+            }
+            uint64_t ticks = (results[2] - results[0]) & validBitMasks_[node];
+            addSample(node, ticks * timestampPeriod_ / 1e6);
+        }
+        written.erase(pending, written.end());
+    }
+    
+    // Has to be called from the thread driving the frame, before the node gets recorded
+    bool beginFrameForNode(NodeHandle node, uint32_t frameIndex) {
+        if (node >= queryIndices_.size() || queryIndices_[node] == NO_QUERY) {
+            return false;
+        }
+        // Resetting queries the device may still write to is a race
+        auto& written = writtenNodes_[frameIndex];
+        if (std::find(written.begin(), written.end(), node) != written.end()) {
+            return false;
+        }
+        written.push_back(node);
+        return true;
+    }
+    
+    // For a node whose command buffer won't be submitted after all
+    void cancelFrameForNode(NodeHandle node, uint32_t frameIndex) {
+        auto& written = writtenNodes_[frameIndex];
+        written.erase(std::remove(written.begin(), written.end(), node), written.end());
+    }
+    
+    void recordBegin(NodeHandle node, uint32_t frameIndex, VkCommandBuffer commandBuffer) {
+        VkQueryPool pool = **queryPools_[frameIndex];
+        vkCmdResetQueryPool(commandBuffer, pool, queryIndices_[node], 2);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, pool, queryIndices_[node]);
+    }
+    
+    void recordEnd(NodeHandle node, uint32_t frameIndex, VkCommandBuffer commandBuffer) {
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, **queryPools_[frameIndex], queryIndices_[node] + 1);
+    }
+    
+    NodeTimingStats getStats(NodeHandle node) {
+        NodeTimingStats stats{};
+        if (node >= timings_.size() || timings_[node].samples.empty()) {
+            return stats;
+        }
+        std::vector<double> sorted = timings_[node].samples;
+        std::sort(sorted.begin(), sorted.end());
+        
+        double total = 0.0;
+        for (double sample : sorted) {
+            total += sample;
+        }
+        stats.sampleCount = static_cast<uint32_t>(sorted.size());
+        stats.meanMs = total / sorted.size();
+        stats.p50Ms = percentile(sorted, 0.50);
+        stats.p99Ms = percentile(sorted, 0.99);
+        return stats;
+    }
+
+private:
+    static constexpr uint32_t NO_QUERY = UINT32_MAX;
+    
+    struct NodeTimings {
+        // Ring buffer of the last SAMPLE_COUNT durations in milliseconds
+        std::vector<double> samples;
+        size_t next = 0;
+    };
+    
+    void addSample(NodeHandle node, double milliseconds) {
+        auto& timings = timings_[node];
+        if (timings.samples.size() < SAMPLE_COUNT) {
+            timings.samples.push_back(milliseconds);
+        } else {
+            timings.samples[timings.next] = milliseconds;
+        }
+        timings.next = (timings.next + 1) % SAMPLE_COUNT;
+    }
+    
+    // Nearest rank on an ascending list
+    static double percentile(const std::vector<double>& sorted, double fraction) {
+        size_t rank = static_cast<size_t>(std::ceil(fraction * sorted.size()));
+        return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+    }
+
+private:
+    VkDevice device_;
+    float timestampPeriod_;
+    std::vector<VkQueueFamilyProperties> queueFamilies_;
+    
+    std::array<std::unique_ptr<VulkanQueryPool>, MAX_FRAMES> queryPools_;
+    uint32_t queryCapacity_ = 0;
+    std::vector<uint32_t> queryIndices_;
+    std::vector<uint64_t> validBitMasks_;
+    // Nodes whose queries were written in each frame slot, waiting to be read back
+    std::array<std::vector<NodeHandle>, MAX_FRAMES> writtenNodes_;
+    std::vector<NodeTimings> timings_;
+};
@@ -0,0 +1,225 @@
+#pragma once
+
+#include "VkTypes.h"
+#include "Buffer.h"
+#include "FrameAllocator.h"
+#include "MemoryAllocator.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <map>
+#include <type_traits>
+#include <vector>
+
+// Device local array edited on the CPU a few elements at a time (instances, transforms...).
+// Edits only mark index ranges dirty, once per frame recordUpload() stages the dirty ranges in the
+// frame allocator and copies them over with a single vkCmdCopyBuffer on the frame's own command buffer,
+// so the copy is ordered after the frames in flight that still read the old contents.
+// The buffer grows by doubling, a replaced buffer is kept until every frame that could use it has completed.
+// Not thread safe, edit from one thread and record the upload outside of a render pass.
+template<typename Data, uint MAX_FRAMES>
+class GpuVector {
+    static_assert(std::is_trivially_copyable<Data>::value, "GpuVector elements are copied as bytes");
+
+public:
+    // Dirty ranges closer than this are uploaded as one region, an extra region costs more than a few bytes
+    static constexpr VkDeviceSize MERGE_GAP = 256;
+
+    // consumerStages and consumerAccess describe how the frame's commands read the buffer
+    GpuVector(VkDevice device,
+              MemoryAllocator& allocator,
+              VkBufferUsageFlags usage,
+              VkPipelineStageFlags consumerStages,
+              VkAccessFlags consumerAccess,
+              size_t initialCapacity = 64)
+    : device_(device),
+    allocator_(allocator),
+    usage_(usage),
+    consumerStages_(consumerStages),
+    consumerAccess_(consumerAccess) {
+        createBuffer(buffer_, std::max<size_t>(initialCapacity, 1));
+    }
+
+    GpuVector(const GpuVector&) = delete;
+    GpuVector& operator=(const GpuVector&) = delete;
+
+    // Changes after recordUpload() reports the buffer was replaced
+    VkBuffer getBuffer() {
+        return buffer_->getBuffer();
+    }
+
+    size_t size() const {
+        return elements_.size();
+    }
+
+    bool empty() const {
+        return elements_.empty();
+    }
+
+    const Data& operator[](size_t index) const {
+        return elements_[index];
+    }
+
+    const std::vector<Data>& getElements() const {
+        return elements_;
+    }
+
+    void push_back(const Data& value) {
+        elements_.push_back(value);
+        markDirty(elements_.size() - 1, elements_.size());
+    }
+
+    // Everything after index moves down, so it all has to be uploaded again
+    void erase(size_t index) {
+        elements_.erase(elements_.begin() + index);
+        if (index < elements_.size()) {
+            markDirty(index, elements_.size());
+        }
+    }
+
+    void update(size_t index, const Data& value) {
+        elements_.at(index) = value;
+        markDirty(index, index + 1);
+    }
+
+    void clear() {
+        elements_.clear();
+        dirtyRanges_.clear();
+    }
+
+    // Copies the dirty ranges into the buffer, growing it first if the elements no longer fit.
+    // Returns whether the buffer was replaced, in which case descriptors pointing at it need rebinding.
+    bool recordUpload(VkCommandBuffer commandBuffer, uint32_t frameIndex, FrameAllocator<MAX_FRAMES>& frameAllocator) {
+        // Retired the last time this frame index came around, every frame since started after it was replaced
+        retiredBuffers_.at(frameIndex).reset();
+
+        bool grow = elements_.size() > capacity_;
+        if (!grow && dirtyRanges_.empty()) {
+            return false;
+        }
+
+        // Earlier frames may still read the ranges about to be overwritten
+        recordBarrier(commandBuffer,
+                      consumerStages_ | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                      VK_ACCESS_TRANSFER_WRITE_BIT,
+                      VK_PIPELINE_STAGE_TRANSFER_BIT,
+                      VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT);
+        if (grow) {
+            recordGrow(commandBuffer, frameIndex);
+        }
+
+        std::vector<VkBufferCopy> regions;
+        VkDeviceSize stagingSize = 0;
+        for (auto& [begin, end] : dirtyRanges_) {
+            size_t last = std::min(end, elements_.size());
+            if (begin >= last) {
+                continue;
+            }
+            VkBufferCopy region{};
+            region.srcOffset = stagingSize;
+            region.dstOffset = begin * sizeof(Data);
+            region.size = (last - begin) * sizeof(Data);
+            regions.push_back(region);
+            stagingSize += region.size;
+        }
+        dirtyRanges_.clear();
+
+        if (!regions.empty()) {
+            FrameSlice slice = frameAllocator.allocate(frameIndex, stagingSize);
+            for (auto& region : regions) {
+                memcpy(static_cast<char*>(slice.data) + region.srcOffset,
+                       reinterpret_cast<const char*>(elements_.data()) + region.dstOffset,
+                       static_cast<size_t>(region.size));
+                region.srcOffset += slice.offset;
+            }
+            vkCmdCopyBuffer(commandBuffer,
+                            frameAllocator.getBuffer(),
+                            buffer_->getBuffer(),
+                            static_cast<uint32_t>(regions.size()),
+                            regions.data());
+        }
+
+        recordBarrier(commandBuffer,
+                      VK_PIPELINE_STAGE_TRANSFER_BIT,
+                      VK_ACCESS_TRANSFER_WRITE_BIT,
+                      consumerStages_,
+                      consumerAccess_);
+        return grow;
+    }
+
+private:
+    void createBuffer(std::unique_ptr<Buffer<Data>>& outBuffer, size_t capacity) {
+        VK_SUCCESS_OR_THROW(Buffer<Data>::create(outBuffer,
+                                                 capacity,
+                                                 usage_ | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                                 device_,
+                                                 allocator_),
+                            "Failed to create gpu vector buffer");
+        capacity_ = capacity;
+    }
+
+    // Elements that aren't up to date in the old buffer are dirty and get overwritten right after
+    void recordGrow(VkCommandBuffer commandBuffer, uint32_t frameIndex) {
+        size_t preserved = std::min(capacity_, elements_.size());
+        std::unique_ptr<Buffer<Data>> buffer;
+        createBuffer(buffer, std::max(elements_.size(), capacity_ * 2));
+
+        if (preserved > 0) {
+            VkBufferCopy region{};
+            region.size = preserved * sizeof(Data);
+            vkCmdCopyBuffer(commandBuffer, buffer_->getBuffer(), buffer->getBuffer(), 1, &region);
+            recordBarrier(commandBuffer,
+                          VK_PIPELINE_STAGE_TRANSFER_BIT,
+                          VK_ACCESS_TRANSFER_WRITE_BIT,
+                          VK_PIPELINE_STAGE_TRANSFER_BIT,
+                          VK_ACCESS_TRANSFER_WRITE_BIT);
+        }
+
+        retiredBuffers_[frameIndex] = std::move(buffer_);
+        buffer_ = std::move(buffer);
+    }
+
+    // Merges [begin, end) with the ranges it overlaps or nearly touches
+    void markDirty(size_t begin, size_t end) {
+        const size_t gap = MERGE_GAP / sizeof(Data);
+        auto it = dirtyRanges_.upper_bound(begin);
+        if (it != dirtyRanges_.begin() && std::prev(it)->second + gap >= begin) {
+            --it;
+            begin = it->first;
+        }
+        while (it != dirtyRanges_.end() && it->first <= end + gap) {
+            end = std::max(end, it->second);
+            it = dirtyRanges_.erase(it);
+        }
+        dirtyRanges_[begin] = end;
+    }
+
+    void recordBarrier(VkCommandBuffer commandBuffer,
+                       VkPipelineStageFlags srcStages,
+                       VkAccessFlags srcAccess,
+                       VkPipelineStageFlags dstStages,
+                       VkAccessFlags dstAccess) {
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = srcAccess;
+        barrier.dstAccessMask = dstAccess;
+        vkCmdPipelineBarrier(commandBuffer, srcStages, dstStages, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
+
+private:
+    VkDevice device_;
+    MemoryAllocator& allocator_;
+    VkBufferUsageFlags usage_;
+    VkPipelineStageFlags consumerStages_;
+    VkAccessFlags consumerAccess_;
+
+    std::vector<Data> elements_;
+    // Element index ranges [first, second) changed since the last upload
+    std::map<size_t, size_t> dirtyRanges_;
+
+    std::unique_ptr<Buffer<Data>> buffer_;
+    size_t capacity_ = 0;
+    std::array<std::unique_ptr<Buffer<Data>>, MAX_FRAMES> retiredBuffers_;
+};
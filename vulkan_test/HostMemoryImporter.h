@@ -0,0 +1,154 @@
+#pragma once
+
+#include "VkTypes.h"
+#include "VkUtil.h"
+#include "MemoryBudget.h"
+
+#include <cstdint>
+
+// Transfer source buffer bound directly to host memory the caller owns
+class ImportedHostBuffer {
+public:
+    ~ImportedHostBuffer() {
+        if (budget_) {
+            budget_->recordResourceFree(memoryTypeIndex_, STAGING_MEMORY, size_);
+            budget_->recordDeviceFree(memoryTypeIndex_, size_);
+        }
+    }
+
+    VkBuffer getBuffer() {
+        return **buffer_;
+    }
+
+private:
+    friend class HostMemoryImporter;
+
+    // Set once the import is reported to it
+    MemoryBudget* budget_ = nullptr;
+    uint32_t memoryTypeIndex_ = 0;
+    VkDeviceSize size_ = 0;
+    // Declared first so it outlives the buffer bound to it
+    std::unique_ptr<VulkanMemory> memory_;
+    std::unique_ptr<VulkanBuffer> buffer_;
+};
+
+// Wraps host allocations as device memory through VK_EXT_external_memory_host, so copies can read
+// decoded assets where they already are instead of going through a memcpy into staging.
+// Only allocations whose address and size are multiples of getAlignment() can be imported,
+// and they must stay valid until every copy reading them has completed.
+// Imports count against the memory budget of the heap they land in, like any other allocation.
+class HostMemoryImporter {
+public:
+    HostMemoryImporter(VkDevice device, VkPhysicalDevice physicalDevice, MemoryBudget& budget, bool extensionEnabled)
+    : device_(device), physicalDevice_(physicalDevice), budget_(budget) {
+        if (!extensionEnabled) {
+            return;
+        }
+        getMemoryHostPointerProperties_ = reinterpret_cast<PFN_vkGetMemoryHostPointerPropertiesEXT>(
+            vkGetDeviceProcAddr(device_, "vkGetMemoryHostPointerPropertiesEXT"));
+
+        VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostProperties{};
+        hostProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
+        VkPhysicalDeviceProperties2 properties{};
+        properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        properties.pNext = &hostProperties;
+        vkGetPhysicalDeviceProperties2(physicalDevice_, &properties);
+        alignment_ = hostProperties.minImportedHostPointerAlignment;
+    }
+
+    HostMemoryImporter(const HostMemoryImporter&) = delete;
+    HostMemoryImporter& operator=(const HostMemoryImporter&) = delete;
+
+    bool isEnabled() {
+        return getMemoryHostPointerProperties_ != nullptr;
+    }
+
+    // Host allocations meant for import should be aligned and sized to this
+    VkDeviceSize getAlignment() {
+        return alignment_;
+    }
+
+    bool canImport(const void* data, VkDeviceSize size) {
+        return isEnabled()
+            && size > 0
+            && reinterpret_cast<uintptr_t>(data) % alignment_ == 0
+            && size % alignment_ == 0;
+    }
+
+    // Fails when the driver won't import this particular allocation, callers fall back to staging then
+    VkResult import(std::unique_ptr<ImportedHostBuffer>& outBuffer, const void* data, VkDeviceSize size) {
+        if (!canImport(data, size)) {
+            return VK_ERROR_INVALID_EXTERNAL_HANDLE;
+        }
+
+        VkMemoryHostPointerPropertiesEXT pointerProperties{};
+        pointerProperties.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+        VkResult result = getMemoryHostPointerProperties_(device_,
+                                                         VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+                                                         data,
+                                                         &pointerProperties);
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+
+        auto imported = std::make_unique<ImportedHostBuffer>();
+
+        VkExternalMemoryBufferCreateInfo externalInfo{};
+        externalInfo.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO;
+        externalInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+        VkBufferCreateInfo bufferInfo{};
+        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferInfo.pNext = &externalInfo;
+        bufferInfo.size = size;
+        bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        result = VulkanBuffer::create(imported->buffer_, device_, bufferInfo);
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+
+        VkMemoryRequirements memoryRequirements;
+        vkGetBufferMemoryRequirements(device_, **imported->buffer_, &memoryRequirements);
+        auto memoryTypeIndex = VulkanMemory::findMemoryType(physicalDevice_,
+                                                            memoryRequirements.memoryTypeBits & pointerProperties.memoryTypeBits,
+                                                            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+        if (!memoryTypeIndex.has_value()) {
+            return VK_ERROR_INVALID_EXTERNAL_HANDLE;
+        }
+
+        VkImportMemoryHostPointerInfoEXT importInfo{};
+        importInfo.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT;
+        importInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+        // The spec takes a non-const pointer, imported memory is only ever read here
+        importInfo.pHostPointer = const_cast<void*>(data);
+        VkMemoryAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.pNext = &importInfo;
+        allocInfo.allocationSize = size;
+        allocInfo.memoryTypeIndex = memoryTypeIndex.value();
+        budget_.reserve(memoryTypeIndex.value(), size);
+        result = VulkanMemory::create(imported->memory_, device_, allocInfo);
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+        budget_.recordDeviceAllocation(memoryTypeIndex.value(), size);
+        budget_.recordResourceAllocation(memoryTypeIndex.value(), STAGING_MEMORY, size);
+        imported->budget_ = &budget_;
+        imported->memoryTypeIndex_ = memoryTypeIndex.value();
+        imported->size_ = size;
+
+        result = vkBindBufferMemory(device_, **imported->buffer_, **imported->memory_, 0);
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+        outBuffer = std::move(imported);
+        return VK_SUCCESS;
+    }
+
+private:
+    VkDevice device_;
+    VkPhysicalDevice physicalDevice_;
+    MemoryBudget& budget_;
+    PFN_vkGetMemoryHostPointerPropertiesEXT getMemoryHostPointerProperties_ = nullptr;
+    VkDeviceSize alignment_ = 1;
+};
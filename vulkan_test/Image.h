@@ -4,9 +4,13 @@
 #include "VkUtil.h"
 #include "CommandUtil.h"
 #include "Buffer.h"
+#include "MemoryAllocator.h"
+#include "Ktx2Texture.h"
 
 #include <stb_image.h>
 
+#include <cmath>
+
 #define RETURN_IF_ERROR(expr)   \
 outResult = expr;               \
 if (outResult != VK_SUCCESS) {  \
@@ -23,14 +27,18 @@ public:
                            VkImageUsageFlags usage,
                            VkMemoryPropertyFlags properties,
                            VkDevice device,
-                           VkPhysicalDevice physicalDevice) {
+                           MemoryAllocator& allocator,
+                           const std::vector<uint32_t>& queueFamilies = {},
+                           uint32_t mipLevels = 1) {
         VkResult result;
         
         outImage = std::make_unique<Image>(width, height,
                                            format, tiling,
                                            usage, properties,
-                                           device, physicalDevice,
-                                           result);
+                                           device, allocator,
+                                           result,
+                                           queueFamilies,
+                                           mipLevels);
         
         return result;
     }
@@ -51,6 +59,20 @@ public:
         return height_;
     }
     
+    uint32_t getMipLevels() {
+        return mipLevels_;
+    }
+    
+    // Device memory bound to the image
+    VkDeviceSize getMemorySize() {
+        return memory_->getSize();
+    }
+    
+    // Levels in a full mip chain down to 1x1
+    static uint32_t getMipLevelCount(uint32_t width, uint32_t height) {
+        return static_cast<uint32_t>(std::floor(std::log2(std::max(width, height)))) + 1;
+    }
+    
     Image(uint32_t width,
           uint32_t height,
           VkFormat format,
@@ -58,14 +80,22 @@ public:
           VkImageUsageFlags usage,
           VkMemoryPropertyFlags properties,
           VkDevice device,
-          VkPhysicalDevice physicalDevice,
-          VkResult& outResult) : device_(device), width_(width), height_(height) {
+          MemoryAllocator& allocator,
+          VkResult& outResult,
+          const std::vector<uint32_t>& queueFamilies = {},
+          uint32_t mipLevels = 1)
+    : device_(device),
+    width_(width),
+    height_(height),
+    format_(format),
+    mipLevels_(mipLevels),
+    subresourceStates_(mipLevels * arrayLayers_) {
         VkImageCreateInfo imageInfo{};
         imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
         imageInfo.imageType = VK_IMAGE_TYPE_2D;
         imageInfo.extent = VkExtent3D{width, height, 1};
-        imageInfo.mipLevels = 1;
-        imageInfo.arrayLayers = 1;
+        imageInfo.mipLevels = mipLevels;
+        imageInfo.arrayLayers = arrayLayers_;
         
         imageInfo.format = format;
         
@@ -73,7 +103,18 @@ public:
         imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED; // first transition discards
         
         imageInfo.usage = usage;
-        imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE; // Only used by graphics queue
+        // Images shared between queue families (graphics & async compute) skip ownership transfers
+        std::vector<uint32_t> uniqueFamilies = queueFamilies;
+        std::sort(uniqueFamilies.begin(), uniqueFamilies.end());
+        uniqueFamilies.erase(std::unique(uniqueFamilies.begin(), uniqueFamilies.end()), uniqueFamilies.end());
+        concurrent_ = uniqueFamilies.size() > 1;
+        if (concurrent_) {
+            imageInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+            imageInfo.queueFamilyIndexCount = static_cast<uint32_t>(uniqueFamilies.size());
+            imageInfo.pQueueFamilyIndices = uniqueFamilies.data();
+        } else {
+            imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE; // Only used by graphics queue
+        }
         
         // Multisampling
         imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
@@ -83,24 +124,27 @@ public:
         VkMemoryRequirements memoryRequirements;
         vkGetImageMemoryRequirements(device_, **image_, &memoryRequirements);
         
-        RETURN_IF_ERROR(VulkanMemory::createFromRequirements(memory_,
-                                                             device_,
-                                                             physicalDevice,
-                                                             properties,
-                                                             memoryRequirements))
+        RETURN_IF_ERROR(allocator.allocate(memory_,
+                                           memoryRequirements,
+                                           properties,
+                                           IMAGE_MEMORY,
+                                           tiling == VK_IMAGE_TILING_OPTIMAL))
         
-        vkBindImageMemory(device_, **image_, **memory_, 0);
+        vkBindImageMemory(device_, **image_, memory_->getMemory(), memory_->getOffset());
         
-        RETURN_IF_ERROR(VulkanImageView::createForImageWithFormat(imageView_, device_, **image_, format));
+        RETURN_IF_ERROR(VulkanImageView::createForImageWithFormat(imageView_, device_, **image_, format, mipLevels));
     }
     
     
+    // The pixels are only recorded on the upload engine, the image
+    // can't be used until the engine's next flush has completed
     static void createFromFile(std::unique_ptr<Image>& outImage,
                                const std::string& filePath,
-                               VkQueue graphicsQueue,
-                               VkCommandPool commandPool,
+                               UploadEngine& uploadEngine,
                                VkDevice device,
-                               VkPhysicalDevice physicalDevice) {
+                               MemoryAllocator& allocator,
+                               const std::vector<uint32_t>& queueFamilies = {},
+                               bool generateMipmaps = false) {
         int width, height, channels;
         
         stbi_uc* pixels = stbi_load((filePath).c_str(), &width, &height, &channels, STBI_rgb_alpha);
@@ -116,174 +160,266 @@ public:
                               width,
                               height,
                               imageSize,
-                              graphicsQueue,
-                              commandPool,
+                              uploadEngine,
                               device,
-                              physicalDevice);
+                              allocator,
+                              queueFamilies,
+                              false,
+                              generateMipmaps);
         
         stbi_image_free(pixels);
     }
     
+    // Loads a KTX2 texture with the mip levels it ships, or a generated chain when it asks for one.
+    // Payloads the device can't sample are decompressed on the CPU when possible, throws otherwise.
+    // The image can't be used until the upload engine's next flush has completed.
+    static void createFromKtx2File(std::unique_ptr<Image>& outImage,
+                                   const std::string& filePath,
+                                   UploadEngine& uploadEngine,
+                                   VkDevice device,
+                                   MemoryAllocator& allocator,
+                                   std::vector<uint32_t> queueFamilies = {}) {
+        std::unique_ptr<Ktx2Texture> texture;
+        Ktx2Texture::load(texture, filePath);
+        if (!uploadEngine.canSampleFormat(texture->getFormat())) {
+            if (!texture->canDecompress()) {
+                throw std::runtime_error("KTX2 texture format not supported by the device.");
+            }
+            texture->decompress();
+        }
+        
+        // Files without a mip chain ask for one to be generated, which only works for formats that can be blitted.
+        // Block-compressed formats can't be, they get just the first level.
+        uint32_t mipLevels = static_cast<uint32_t>(texture->getLevels().size());
+        VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+        bool generateMipmaps = texture->requestsMipmaps() && uploadEngine.canGenerateMipmaps(texture->getFormat());
+        if (generateMipmaps) {
+            mipLevels = getMipLevelCount(texture->getWidth(), texture->getHeight());
+            usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        }
+        
+        // Concurrent images are written by the transfer queue directly
+        if (!queueFamilies.empty()) {
+            queueFamilies.push_back(uploadEngine.getQueueFamily());
+        }
+        VK_SUCCESS_OR_THROW(Image::create(outImage,
+                                          texture->getWidth(), texture->getHeight(),
+                                          texture->getFormat(),
+                                          VK_IMAGE_TILING_OPTIMAL,
+                                          usage,
+                                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                          device, allocator,
+                                          queueFamilies,
+                                          mipLevels),
+                            "Failed to create image.");
+        
+        // With a generated chain the first level is left for the blits to read from
+        uploadEngine.uploadToImageLevels(texture->getData(),
+                                         texture->getLevels(),
+                                         outImage->getImage(),
+                                         texture->getBlockExtent(),
+                                         generateMipmaps ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                         outImage->concurrent_);
+        if (generateMipmaps) {
+            uploadEngine.generateMipmaps(outImage->getImage(),
+                                         texture->getFormat(),
+                                         texture->getWidth(), texture->getHeight(),
+                                         mipLevels,
+                                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+        }
+        outImage->setLayout(VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+    }
+    
+    // Pass pixelsOutliveUpload when the pixels stay valid until the upload completes, allocations
+    // aligned and padded for HostMemoryImporter are then copied from in place rather than staged.
+    // generateMipmaps builds the full chain on the GPU, formats that can't be blitted get a single level.
     static void createFromUcharBuffer(std::unique_ptr<Image>& outImage,
                                       unsigned char* pixels,
                                       uint32_t width,
                                       uint32_t height,
                                       VkDeviceSize imageSize,
-                                      VkQueue graphicsQueue,
-                                      VkCommandPool commandPool,
+                                      UploadEngine& uploadEngine,
                                       VkDevice device,
-                                      VkPhysicalDevice physicalDevice) {
+                                      MemoryAllocator& allocator,
+                                      std::vector<uint32_t> queueFamilies = {},
+                                      bool pixelsOutliveUpload = false,
+                                      bool generateMipmaps = false) {
+        const VkFormat format = VK_FORMAT_R8G8B8A8_SRGB;
+        uint32_t mipLevels = generateMipmaps && uploadEngine.canGenerateMipmaps(format)
+            ? getMipLevelCount(width, height)
+            : 1;
+        VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
+        if (mipLevels > 1) {
+            // Each level is blitted from the one above
+            usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        }
+        // Concurrent images are written by the transfer queue directly
+        if (!queueFamilies.empty()) {
+            queueFamilies.push_back(uploadEngine.getQueueFamily());
+        }
         VK_SUCCESS_OR_THROW(Image::create(outImage,
                                           width, height,
-                                          VK_FORMAT_R8G8B8A8_SRGB,
+                                          format,
                                           VK_IMAGE_TILING_OPTIMAL,
-                                          VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT,
+                                          usage,
                                           VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                          device, physicalDevice),
+                                          device, allocator,
+                                          queueFamilies,
+                                          mipLevels),
                             "Failed to create image.");
 
-        outImage->uploadUcharBufferToImage(pixels, imageSize, graphicsQueue, commandPool, physicalDevice);
+        outImage->uploadUcharBufferToImage(pixels, imageSize, uploadEngine, pixelsOutliveUpload);
     }
     
+    // The image starts out undefined, the first transitionTo() puts it in the layout its user needs
     static void createEmptyRGBA(std::unique_ptr<Image>& outImage,
                                 uint32_t width,
                                 uint32_t height,
-                                VkQueue queue,
-                                VkCommandPool commandPool,
                                 VkDevice device,
-                                VkPhysicalDevice physicalDevice) {
-        createEmpty(outImage, VK_FORMAT_R8G8B8A8_SRGB, width, height, queue, commandPool, device, physicalDevice);
+                                MemoryAllocator& allocator) {
+        createEmpty(outImage, VK_FORMAT_R8G8B8A8_SRGB, width, height, device, allocator);
     }
 
     static void createEmpty(std::unique_ptr<Image>& outImage,
                             VkFormat format,
                             uint32_t width,
                             uint32_t height,
-                            VkQueue queue,
-                            VkCommandPool commandPool,
                             VkDevice device,
-                            VkPhysicalDevice physicalDevice) {
+                            MemoryAllocator& allocator) {
         VK_SUCCESS_OR_THROW(Image::create(outImage,
                                           width, height,
                                           format,
                                           VK_IMAGE_TILING_OPTIMAL,
                                           VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT,
                                           VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                          device, physicalDevice),
+                                          device, allocator),
                             "Failed to create image.");
-        
-        transitionImageLayout(outImage->getImage(),
-                              format,
-                              VK_IMAGE_LAYOUT_UNDEFINED,
-                              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-                              queue, commandPool, device);
     }
 
-    void uploadUcharBufferToImage(unsigned char* pixels, 
+    void uploadUcharBufferToImage(unsigned char* pixels,
                                   VkDeviceSize imageSize,
-                                  VkQueue graphicsQueue,
-                                  VkCommandPool commandPool,
-                                  VkPhysicalDevice physicalDevice) {
-        std::unique_ptr<Buffer<uint8_t>> stagingBuffer;
-        VK_SUCCESS_OR_THROW(Buffer<uint8_t>::create(stagingBuffer, imageSize,
-                                                    VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                                                    device_, physicalDevice),
-                            "Failed to create image staging buffer");
-        
-        stagingBuffer->mapAndExecute(0, imageSize, [pixels, imageSize] (void* data) {
-            memcpy(data, pixels, static_cast<size_t>(imageSize));
-        });
-
-        transitionImageLayout(getImage(),
-                              VK_FORMAT_R8G8B8A8_SRGB,
-                              VK_IMAGE_LAYOUT_UNDEFINED,
-                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                              graphicsQueue, commandPool, device_);
-
-        copyBufferToImage(stagingBuffer->getBuffer(),
-                          getImage(),
-                          width_, height_,
-                          graphicsQueue, commandPool, device_);
-
-        transitionImageLayout(getImage(),
-                              VK_FORMAT_R8G8B8A8_SRGB,
-                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-                              graphicsQueue, commandPool, device_);
+                                  UploadEngine& uploadEngine,
+                                  bool pixelsOutliveUpload = false) {
+        // With a mip chain the first level is left for the blits to read from
+        uploadEngine.uploadToImage(pixels,
+                                   imageSize,
+                                   getImage(),
+                                   width_, height_,
+                                   mipLevels_ > 1 ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                   concurrent_,
+                                   pixelsOutliveUpload);
+        if (mipLevels_ > 1) {
+            uploadEngine.generateMipmaps(getImage(),
+                                         format_,
+                                         width_, height_,
+                                         mipLevels_,
+                                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+        }
+        setLayout(VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
     }
     
-    static void transitionImageLayout(VkImage image,
-                                      VkFormat format,
-                                      VkImageLayout oldLayout,
-                                      VkImageLayout newLayout,
-                                      VkQueue graphicsQueue,
-                                      VkCommandPool commandPool,
-                                      VkDevice device) {
-        issueSingleTimeCommand([=](VkCommandBuffer commandBuffer){
-            VkImageMemoryBarrier barrier{};
-            barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-            barrier.oldLayout = oldLayout;
-            barrier.newLayout = newLayout;
-            
-            // Must be set. Barrier can be used to transfer queue ownership.
-            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            
-            barrier.image = image;
-            barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-            barrier.subresourceRange.baseMipLevel = 0;
-            barrier.subresourceRange.levelCount = 1;
-            barrier.subresourceRange.baseArrayLayer = 0;
-            barrier.subresourceRange.layerCount = 1;
-            
-            VkPipelineStageFlags sourceStage;
-            VkPipelineStageFlags destinationStage;
-
-            if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
-                barrier.srcAccessMask = 0; // Nothing to wait on
-                barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-                sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT; // Earliest possible stage
-                destinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT; // Not a "real" stage, but is where transfers happen?
-            } else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-                barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-                barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    // Layout of a subresource as of the last command recorded through transitionTo()
+    VkImageLayout getLayout(uint32_t mipLevel = 0, uint32_t arrayLayer = 0) {
+        return subresourceStates_.at(mipLevel * arrayLayers_ + arrayLayer).layout;
+    }
+    
+    // Records the barriers moving the subresources to newLayout for access at stage into commandBuffer.
+    // Subresources already in newLayout that were only read and are only read again are left alone.
+    // The tracked state follows recording order, so command buffers have to be submitted in the
+    // order they were recorded in, and exclusive images can't change queue family through here.
+    void transitionTo(VkCommandBuffer commandBuffer,
+                      VkImageLayout newLayout,
+                      VkPipelineStageFlags stage,
+                      VkAccessFlags access,
+                      uint32_t baseMipLevel = 0,
+                      uint32_t levelCount = VK_REMAINING_MIP_LEVELS,
+                      uint32_t baseArrayLayer = 0,
+                      uint32_t layerCount = VK_REMAINING_ARRAY_LAYERS) {
+        levelCount = levelCount == VK_REMAINING_MIP_LEVELS ? mipLevels_ - baseMipLevel : levelCount;
+        layerCount = layerCount == VK_REMAINING_ARRAY_LAYERS ? arrayLayers_ - baseArrayLayer : layerCount;
+        
+        std::vector<VkImageMemoryBarrier> barriers;
+        VkPipelineStageFlags srcStages = 0;
+        for (uint32_t layer = baseArrayLayer; layer < baseArrayLayer + layerCount; ++layer) {
+            for (uint32_t level = baseMipLevel; level < baseMipLevel + levelCount; ++level) {
+                auto& state = subresourceStates_.at(level * arrayLayers_ + layer);
+                if (state.layout == newLayout && !(state.access & WRITE_ACCESS) && !(access & WRITE_ACCESS)) {
+                    // Reads after reads don't need a barrier, the next write has to wait on all of them though
+                    state.stages |= stage;
+                    state.access |= access;
+                    continue;
+                }
+                
+                // Only writes have to be made available, earlier reads just have to finish
+                VkAccessFlags srcAccess = state.access & WRITE_ACCESS;
+                srcStages |= state.stages != 0 ? state.stages : static_cast<VkPipelineStageFlags>(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
                 
-                sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-                destinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-            } else if(oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-                barrier.srcAccessMask = 0; // Nothing to wait on
-                barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+                // Consecutive levels coming from the same state share a barrier
+                auto* previous = barriers.empty() ? nullptr : &barriers.back();
+                if (previous
+                    && previous->subresourceRange.baseArrayLayer == layer
+                    && previous->subresourceRange.baseMipLevel + previous->subresourceRange.levelCount == level
+                    && previous->oldLayout == state.layout
+                    && previous->srcAccessMask == srcAccess) {
+                    ++previous->subresourceRange.levelCount;
+                } else {
+                    VkImageMemoryBarrier barrier{};
+                    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+                    barrier.oldLayout = state.layout;
+                    barrier.newLayout = newLayout;
+                    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                    barrier.image = **image_;
+                    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+                    barrier.subresourceRange.baseMipLevel = level;
+                    barrier.subresourceRange.levelCount = 1;
+                    barrier.subresourceRange.baseArrayLayer = layer;
+                    barrier.subresourceRange.layerCount = 1;
+                    barrier.srcAccessMask = srcAccess;
+                    barrier.dstAccessMask = access;
+                    barriers.push_back(barrier);
+                }
                 
-                sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-                destinationStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-            } else {
-                // TODO better handling
-                throw std::invalid_argument("unsupported layout transition!");
+                state = {newLayout, stage, access};
             }
-
-            
-            vkCmdPipelineBarrier(
-                commandBuffer,
-                sourceStage,
-                destinationStage,
-                0,
-                0, nullptr,
-                0, nullptr,
-                1, &barrier
-            );
-        }, graphicsQueue, device, commandPool);
+        }
+        
+        if (barriers.empty()) {
+            return;
+        }
+        vkCmdPipelineBarrier(commandBuffer,
+                             srcStages,
+                             stage,
+                             0,
+                             0, nullptr,
+                             0, nullptr,
+                             static_cast<uint32_t>(barriers.size()), barriers.data());
+    }
+    
+    // Records a layout the subresources reached outside of transitionTo(), like at the end of an upload,
+    // along with the stage and access that left them there for the next transition to wait on.
+    void setLayout(VkImageLayout layout,
+                   VkPipelineStageFlags stage,
+                   VkAccessFlags access,
+                   uint32_t baseMipLevel = 0,
+                   uint32_t levelCount = VK_REMAINING_MIP_LEVELS,
+                   uint32_t baseArrayLayer = 0,
+                   uint32_t layerCount = VK_REMAINING_ARRAY_LAYERS) {
+        levelCount = levelCount == VK_REMAINING_MIP_LEVELS ? mipLevels_ - baseMipLevel : levelCount;
+        layerCount = layerCount == VK_REMAINING_ARRAY_LAYERS ? arrayLayers_ - baseArrayLayer : layerCount;
+        for (uint32_t layer = baseArrayLayer; layer < baseArrayLayer + layerCount; ++layer) {
+            for (uint32_t level = baseMipLevel; level < baseMipLevel + levelCount; ++level) {
+                subresourceStates_.at(level * arrayLayers_ + layer) = {layout, stage, access};
+            }
+        }
     }
     
-    static void copyBufferToImage(VkBuffer buffer,
-                                  VkImage image,
-                                  uint32_t width,
-                                  uint32_t height,
-                                  VkQueue graphicsQueue,
-                                  VkCommandPool commandPool,
-                                  VkDevice device) {
-        issueSingleTimeCommand([=](VkCommandBuffer commandBuffer){
+    static ImmediateCommands::Token copyBufferToImage(VkBuffer buffer,
+                                                      VkImage image,
+                                                      uint32_t width,
+                                                      uint32_t height,
+                                                      ImmediateCommands& immediateCommands) {
+        return immediateCommands.record([=](VkCommandBuffer commandBuffer){
             VkBufferImageCopy region{};
             region.bufferOffset = 0;
             region.bufferRowLength = 0;
@@ -309,16 +445,39 @@ public:
                 1,
                 &region
             );
-        }, graphicsQueue, device, commandPool);
+        });
     }
+private:
+    // Access bits that make a barrier necessary even when the layout doesn't change
+    static constexpr VkAccessFlags WRITE_ACCESS = VK_ACCESS_SHADER_WRITE_BIT
+        | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+        | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT
+        | VK_ACCESS_TRANSFER_WRITE_BIT
+        | VK_ACCESS_HOST_WRITE_BIT
+        | VK_ACCESS_MEMORY_WRITE_BIT;
+    
+    // Last recorded use of one mip level of one array layer
+    struct SubresourceState {
+        VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        VkPipelineStageFlags stages = 0;
+        VkAccessFlags access = 0;
+    };
+    
 private:
     VkDevice device_;
+    // Declared first so the range outlives the image bound to it
+    std::unique_ptr<MemoryAllocation> memory_;
     std::unique_ptr<VulkanImage> image_;
-    std::unique_ptr<VulkanMemory> memory_;
     
     std::unique_ptr<VulkanImageView> imageView_;
     std::unique_ptr<VulkanSampler> sampler_;
     
     uint32_t width_;
     uint32_t height_;
+    VkFormat format_;
+    uint32_t mipLevels_;
+    uint32_t arrayLayers_ = 1;
+    bool concurrent_ = false;
+    // Indexed by mip level * array layers + array layer
+    std::vector<SubresourceState> subresourceStates_;
 };
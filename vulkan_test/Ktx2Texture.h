@@ -0,0 +1,364 @@
+#pragma once
+
+#include "VkTypes.h"
+#include "FileUtil.h"
+#include "UploadEngine.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// 2D texture read from a KTX2 container, with the payload in the format the file was encoded in
+// (BC, ETC2/EAC, ASTC or plain) and every mip level it ships, largest first.
+// Supercompressed files (BasisLZ, zstd...) aren't supported, they need a transcoder.
+class Ktx2Texture {
+public:
+    // Throws if the file isn't a KTX2 container this can read
+    static void load(std::unique_ptr<Ktx2Texture>& outTexture, const std::string& filePath) {
+        auto texture = std::make_unique<Ktx2Texture>();
+        texture->data_ = readFile(filePath);
+        texture->parse();
+        outTexture = std::move(texture);
+    }
+
+    VkFormat getFormat() {
+        return format_;
+    }
+
+    uint32_t getWidth() {
+        return width_;
+    }
+
+    uint32_t getHeight() {
+        return height_;
+    }
+
+    const char* getData() {
+        return data_.data();
+    }
+
+    const std::vector<ImageLevel>& getLevels() {
+        return levels_;
+    }
+
+    VkExtent2D getBlockExtent() {
+        return getBlockExtent(format_);
+    }
+
+    // The file only ships its first level and leaves generating the rest to the loader
+    bool requestsMipmaps() {
+        return requestsMipmaps_;
+    }
+
+    // Texel block size of compressed formats, {1, 1} for everything else
+    static VkExtent2D getBlockExtent(VkFormat format) {
+        switch (format) {
+            case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+            case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+            case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+            case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+            case VK_FORMAT_BC2_UNORM_BLOCK:
+            case VK_FORMAT_BC2_SRGB_BLOCK:
+            case VK_FORMAT_BC3_UNORM_BLOCK:
+            case VK_FORMAT_BC3_SRGB_BLOCK:
+            case VK_FORMAT_BC4_UNORM_BLOCK:
+            case VK_FORMAT_BC4_SNORM_BLOCK:
+            case VK_FORMAT_BC5_UNORM_BLOCK:
+            case VK_FORMAT_BC5_SNORM_BLOCK:
+            case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+            case VK_FORMAT_BC6H_SFLOAT_BLOCK:
+            case VK_FORMAT_BC7_UNORM_BLOCK:
+            case VK_FORMAT_BC7_SRGB_BLOCK:
+            case VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK:
+            case VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK:
+            case VK_FORMAT_ETC2_R8G8B8A1_UNORM_BLOCK:
+            case VK_FORMAT_ETC2_R8G8B8A1_SRGB_BLOCK:
+            case VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK:
+            case VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK:
+            case VK_FORMAT_EAC_R11_UNORM_BLOCK:
+            case VK_FORMAT_EAC_R11_SNORM_BLOCK:
+            case VK_FORMAT_EAC_R11G11_UNORM_BLOCK:
+            case VK_FORMAT_EAC_R11G11_SNORM_BLOCK:
+            case VK_FORMAT_ASTC_4x4_UNORM_BLOCK:
+            case VK_FORMAT_ASTC_4x4_SRGB_BLOCK:
+                return {4, 4};
+            case VK_FORMAT_ASTC_5x4_UNORM_BLOCK:
+            case VK_FORMAT_ASTC_5x4_SRGB_BLOCK:
+                return {5, 4};
+            case VK_FORMAT_ASTC_5x5_UNORM_BLOCK:
+            case VK_FORMAT_ASTC_5x5_SRGB_BLOCK:
+                return {5, 5};
+            case VK_FORMAT_ASTC_6x5_UNORM_BLOCK:
+            case VK_FORMAT_ASTC_6x5_SRGB_BLOCK:
+                return {6, 5};
+            case VK_FORMAT_ASTC_6x6_UNORM_BLOCK:
+            case VK_FORMAT_ASTC_6x6_SRGB_BLOCK:
+                return {6, 6};
+            case VK_FORMAT_ASTC_8x5_UNORM_BLOCK:
+            case VK_FORMAT_ASTC_8x5_SRGB_BLOCK:
+                return {8, 5};
+            case VK_FORMAT_ASTC_8x6_UNORM_BLOCK:
+            case VK_FORMAT_ASTC_8x6_SRGB_BLOCK:
+                return {8, 6};
+            case VK_FORMAT_ASTC_8x8_UNORM_BLOCK:
+            case VK_FORMAT_ASTC_8x8_SRGB_BLOCK:
+                return {8, 8};
+            case VK_FORMAT_ASTC_10x5_UNORM_BLOCK:
+            case VK_FORMAT_ASTC_10x5_SRGB_BLOCK:
+                return {10, 5};
+            case VK_FORMAT_ASTC_10x6_UNORM_BLOCK:
+            case VK_FORMAT_ASTC_10x6_SRGB_BLOCK:
+                return {10, 6};
+            case VK_FORMAT_ASTC_10x8_UNORM_BLOCK:
+            case VK_FORMAT_ASTC_10x8_SRGB_BLOCK:
+                return {10, 8};
+            case VK_FORMAT_ASTC_10x10_UNORM_BLOCK:
+            case VK_FORMAT_ASTC_10x10_SRGB_BLOCK:
+                return {10, 10};
+            case VK_FORMAT_ASTC_12x10_UNORM_BLOCK:
+            case VK_FORMAT_ASTC_12x10_SRGB_BLOCK:
+                return {12, 10};
+            case VK_FORMAT_ASTC_12x12_UNORM_BLOCK:
+            case VK_FORMAT_ASTC_12x12_SRGB_BLOCK:
+                return {12, 12};
+            default:
+                return {1, 1};
+        }
+    }
+
+    // Whether decompress() can turn the payload into RGBA8 for devices that can't sample it
+    bool canDecompress() {
+        switch (format_) {
+            case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+            case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+            case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+            case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+            case VK_FORMAT_BC2_UNORM_BLOCK:
+            case VK_FORMAT_BC2_SRGB_BLOCK:
+            case VK_FORMAT_BC3_UNORM_BLOCK:
+            case VK_FORMAT_BC3_SRGB_BLOCK:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Decodes every level to R8G8B8A8, keeping the sRGB-ness of the original format
+    void decompress() {
+        if (!canDecompress()) {
+            throw std::runtime_error("KTX2 texture format can't be decompressed.");
+        }
+
+        bool srgb = format_ == VK_FORMAT_BC1_RGB_SRGB_BLOCK
+            || format_ == VK_FORMAT_BC1_RGBA_SRGB_BLOCK
+            || format_ == VK_FORMAT_BC2_SRGB_BLOCK
+            || format_ == VK_FORMAT_BC3_SRGB_BLOCK;
+        std::vector<ImageLevel> levels;
+        VkDeviceSize decompressedSize = 0;
+        for (auto& level : levels_) {
+            levels.push_back({decompressedSize, static_cast<VkDeviceSize>(level.width) * level.height * 4, level.width, level.height});
+            decompressedSize += levels.back().size;
+        }
+        std::vector<char> decompressed(decompressedSize);
+
+        for (size_t levelIdx = 0; levelIdx < levels_.size(); ++levelIdx) {
+            auto& level = levels_[levelIdx];
+            auto* src = reinterpret_cast<const uint8_t*>(data_.data() + level.offset);
+            auto* dst = reinterpret_cast<uint8_t*>(decompressed.data() + levels[levelIdx].offset);
+            uint32_t blocksX = (level.width + 3) / 4;
+            uint32_t blocksY = (level.height + 3) / 4;
+            for (uint32_t blockY = 0; blockY < blocksY; ++blockY) {
+                for (uint32_t blockX = 0; blockX < blocksX; ++blockX) {
+                    std::array<uint8_t, 64> texels;
+                    decodeBlock(src + (blockY * blocksX + blockX) * blockSize_, texels);
+                    // Blocks hanging over the edge of small levels are cropped
+                    uint32_t rows = std::min(4u, level.height - blockY * 4);
+                    uint32_t columns = std::min(4u, level.width - blockX * 4);
+                    for (uint32_t row = 0; row < rows; ++row) {
+                        size_t dstOffset = ((static_cast<size_t>(blockY) * 4 + row) * level.width + blockX * 4) * 4;
+                        memcpy(dst + dstOffset, texels.data() + row * 16, columns * 4);
+                    }
+                }
+            }
+        }
+
+        data_ = std::move(decompressed);
+        levels_ = std::move(levels);
+        format_ = srgb ? VK_FORMAT_R8G8B8A8_SRGB : VK_FORMAT_R8G8B8A8_UNORM;
+        blockSize_ = 4;
+    }
+
+private:
+    static constexpr uint8_t IDENTIFIER[12] = {0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'};
+
+    // Fields the loader needs, the data format descriptor and key/value data are skipped
+    struct Header {
+        uint32_t vkFormat;
+        uint32_t typeSize;
+        uint32_t pixelWidth;
+        uint32_t pixelHeight;
+        uint32_t pixelDepth;
+        uint32_t layerCount;
+        uint32_t faceCount;
+        uint32_t levelCount;
+        uint32_t supercompressionScheme;
+    };
+
+    struct LevelIndex {
+        uint64_t byteOffset;
+        uint64_t byteLength;
+        uint64_t uncompressedByteLength;
+    };
+
+    // Header, then the dfd, kvd and sgd offsets and lengths (4 x 32 bit, 2 x 64 bit) before the level index
+    static constexpr size_t DFD_INDEX_OFFSET = sizeof(IDENTIFIER) + sizeof(Header);
+    static constexpr size_t LEVEL_INDEX_OFFSET = DFD_INDEX_OFFSET + 4 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+    // bytesPlane0 of the basic descriptor block: total size, then 4 words ahead of it
+    static constexpr size_t DFD_BYTES_PLANE0_OFFSET = sizeof(uint32_t) + 4 * sizeof(uint32_t);
+
+    void parse() {
+        Header header;
+        if (data_.size() < LEVEL_INDEX_OFFSET
+            || memcmp(data_.data(), IDENTIFIER, sizeof(IDENTIFIER)) != 0) {
+            throw std::runtime_error("Not a KTX2 file.");
+        }
+        memcpy(&header, data_.data() + sizeof(IDENTIFIER), sizeof(Header));
+
+        if (header.vkFormat == 0 || header.supercompressionScheme != 0) {
+            throw std::runtime_error("Supercompressed KTX2 textures are not supported.");
+        }
+        if (header.pixelHeight == 0 || header.pixelDepth > 1 || header.layerCount > 1 || header.faceCount != 1) {
+            throw std::runtime_error("Only 2D KTX2 textures are supported.");
+        }
+
+        format_ = static_cast<VkFormat>(header.vkFormat);
+        width_ = header.pixelWidth;
+        height_ = header.pixelHeight;
+
+        // The data format descriptor has the size of a texel block, whatever the format
+        uint32_t dfdOffset;
+        uint32_t dfdLength;
+        memcpy(&dfdOffset, data_.data() + DFD_INDEX_OFFSET, sizeof(uint32_t));
+        memcpy(&dfdLength, data_.data() + DFD_INDEX_OFFSET + sizeof(uint32_t), sizeof(uint32_t));
+        if (dfdLength <= DFD_BYTES_PLANE0_OFFSET || static_cast<uint64_t>(dfdOffset) + dfdLength > data_.size()) {
+            throw std::runtime_error("Truncated KTX2 data format descriptor.");
+        }
+        blockSize_ = static_cast<uint8_t>(data_[dfdOffset + DFD_BYTES_PLANE0_OFFSET]);
+        bool bc1 = format_ >= VK_FORMAT_BC1_RGB_UNORM_BLOCK && format_ <= VK_FORMAT_BC1_RGBA_SRGB_BLOCK;
+        if (blockSize_ == 0 || (canDecompress() && blockSize_ != (bc1 ? 8u : 16u))) {
+            throw std::runtime_error("KTX2 data format descriptor doesn't match the texture format.");
+        }
+
+        // A level count of 0 asks the loader to generate the mips, only the first level is in the file then
+        requestsMipmaps_ = header.levelCount == 0;
+        uint32_t levelCount = std::max(header.levelCount, 1u);
+        if (data_.size() < LEVEL_INDEX_OFFSET + static_cast<uint64_t>(levelCount) * sizeof(LevelIndex)) {
+            throw std::runtime_error("Truncated KTX2 level index.");
+        }
+        VkExtent2D blockExtent = getBlockExtent();
+        for (uint32_t level = 0; level < levelCount; ++level) {
+            LevelIndex index;
+            memcpy(&index, data_.data() + LEVEL_INDEX_OFFSET + level * sizeof(LevelIndex), sizeof(LevelIndex));
+            uint32_t width = std::max(width_ >> level, 1u);
+            uint32_t height = std::max(height_ >> level, 1u);
+            // Copies and decompression read whole blocks, a short level would have them read past it
+            uint64_t blocksX = (width + blockExtent.width - 1) / blockExtent.width;
+            uint64_t blocksY = (height + blockExtent.height - 1) / blockExtent.height;
+            uint64_t levelSize = blocksX * blocksY * blockSize_;
+            if (index.byteLength < levelSize
+                || index.byteOffset > data_.size()
+                || index.byteLength > data_.size() - index.byteOffset) {
+                throw std::runtime_error("Truncated KTX2 level data.");
+            }
+            levels_.push_back({index.byteOffset, levelSize, width, height});
+        }
+    }
+
+    // Writes the 4x4 texels of a BC1, BC2 or BC3 block as RGBA8, row by row
+    void decodeBlock(const uint8_t* block, std::array<uint8_t, 64>& outTexels) {
+        bool bc1 = blockSize_ == 8;
+        const uint8_t* colorBlock = bc1 ? block : block + 8;
+
+        uint16_t color0 = colorBlock[0] | (colorBlock[1] << 8);
+        uint16_t color1 = colorBlock[2] | (colorBlock[3] << 8);
+        std::array<std::array<uint8_t, 4>, 4> palette;
+        palette[0] = expand565(color0);
+        palette[1] = expand565(color1);
+        // BC2 and BC3 always interpolate, BC1 switches to a punch-through black when color0 <= color1
+        if (!bc1 || color0 > color1) {
+            for (int channel = 0; channel < 3; ++channel) {
+                palette[2][channel] = static_cast<uint8_t>((2 * palette[0][channel] + palette[1][channel]) / 3);
+                palette[3][channel] = static_cast<uint8_t>((palette[0][channel] + 2 * palette[1][channel]) / 3);
+            }
+            palette[2][3] = palette[3][3] = 255;
+        } else {
+            for (int channel = 0; channel < 3; ++channel) {
+                palette[2][channel] = static_cast<uint8_t>((palette[0][channel] + palette[1][channel]) / 2);
+                palette[3][channel] = 0;
+            }
+            palette[2][3] = 255;
+            bool opaque = format_ == VK_FORMAT_BC1_RGB_UNORM_BLOCK || format_ == VK_FORMAT_BC1_RGB_SRGB_BLOCK;
+            palette[3][3] = opaque ? 255 : 0;
+        }
+
+        uint32_t colorIndices = colorBlock[4] | (colorBlock[5] << 8) | (colorBlock[6] << 16) | (static_cast<uint32_t>(colorBlock[7]) << 24);
+        for (int texel = 0; texel < 16; ++texel) {
+            memcpy(outTexels.data() + texel * 4, palette[(colorIndices >> (texel * 2)) & 3].data(), 4);
+        }
+
+        if (format_ == VK_FORMAT_BC2_UNORM_BLOCK || format_ == VK_FORMAT_BC2_SRGB_BLOCK) {
+            // Explicit 4 bit alpha per texel
+            for (int texel = 0; texel < 16; ++texel) {
+                uint8_t alpha = (block[texel / 2] >> ((texel % 2) * 4)) & 0xF;
+                outTexels[texel * 4 + 3] = static_cast<uint8_t>(alpha * 17);
+            }
+        } else if (format_ == VK_FORMAT_BC3_UNORM_BLOCK || format_ == VK_FORMAT_BC3_SRGB_BLOCK) {
+            // Two endpoints and 3 bit indices into the ramp between them
+            std::array<uint8_t, 8> alphas;
+            alphas[0] = block[0];
+            alphas[1] = block[1];
+            if (alphas[0] > alphas[1]) {
+                for (int step = 1; step < 7; ++step) {
+                    alphas[step + 1] = static_cast<uint8_t>(((7 - step) * alphas[0] + step * alphas[1]) / 7);
+                }
+            } else {
+                for (int step = 1; step < 5; ++step) {
+                    alphas[step + 1] = static_cast<uint8_t>(((5 - step) * alphas[0] + step * alphas[1]) / 5);
+                }
+                alphas[6] = 0;
+                alphas[7] = 255;
+            }
+            uint64_t alphaIndices = 0;
+            for (int byte = 0; byte < 6; ++byte) {
+                alphaIndices |= static_cast<uint64_t>(block[2 + byte]) << (byte * 8);
+            }
+            for (int texel = 0; texel < 16; ++texel) {
+                outTexels[texel * 4 + 3] = alphas[(alphaIndices >> (texel * 3)) & 7];
+            }
+        }
+    }
+
+    static std::array<uint8_t, 4> expand565(uint16_t color) {
+        uint8_t red = (color >> 11) & 0x1F;
+        uint8_t green = (color >> 5) & 0x3F;
+        uint8_t blue = color & 0x1F;
+        return {static_cast<uint8_t>((red << 3) | (red >> 2)),
+                static_cast<uint8_t>((green << 2) | (green >> 4)),
+                static_cast<uint8_t>((blue << 3) | (blue >> 2)),
+                255};
+    }
+
+private:
+    // The whole file, levels point into it until the texture is decompressed
+    std::vector<char> data_;
+    std::vector<ImageLevel> levels_;
+    VkFormat format_ = VK_FORMAT_UNDEFINED;
+    uint32_t width_ = 0;
+    uint32_t height_ = 0;
+    // Bytes per texel block, per texel for uncompressed formats
+    VkDeviceSize blockSize_ = 0;
+    bool requestsMipmaps_ = false;
+};
@@ -0,0 +1,463 @@
+#pragma once
+
+#include "VkTypes.h"
+#include "VkUtil.h"
+#include "MemoryBudget.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <vector>
+
+struct HeapStats {
+    VkDeviceSize heapSize;
+    // Device memory reserved from the heap, unused space in blocks included
+    VkDeviceSize reservedBytes;
+    // Bytes handed out to resources, rounding and alignment included
+    VkDeviceSize usedBytes;
+    uint32_t blockCount;
+    uint32_t allocationCount;
+};
+
+class MemoryAllocator;
+
+// Sub-range of a device memory block, handed back to the allocator when destroyed
+class MemoryAllocation {
+public:
+    ~MemoryAllocation();
+
+    MemoryAllocation(const MemoryAllocation&) = delete;
+    MemoryAllocation& operator=(const MemoryAllocation&) = delete;
+
+    VkDeviceMemory getMemory() {
+        return memory_;
+    }
+
+    VkDeviceSize getOffset() {
+        return offset_;
+    }
+
+    VkDeviceSize getSize() {
+        return size_;
+    }
+
+    // Start of the allocation in the block's persistent mapping, null unless the memory is host visible
+    void* getMappedData() {
+        return mappedData_;
+    }
+
+    // Host writes to non-coherent memory need flushing, and device writes invalidating, before the other side sees them
+    bool isCoherent() {
+        return nonCoherentAtomSize_ == 0;
+    }
+
+    // Range of the allocation widened to whole atoms, as vkFlushMappedMemoryRanges requires
+    VkMappedMemoryRange getMappedRange(VkDeviceSize offset, VkDeviceSize size) {
+        if (size == VK_WHOLE_SIZE) {
+            size = size_ - offset;
+        }
+        VkDeviceSize atom = isCoherent() ? 1 : nonCoherentAtomSize_;
+        VkDeviceSize start = (offset_ + offset) / atom * atom;
+        VkDeviceSize end = std::min((offset_ + offset + size + atom - 1) / atom * atom, blockSize_);
+
+        VkMappedMemoryRange range{};
+        range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+        range.memory = memory_;
+        range.offset = start;
+        range.size = end - start;
+        return range;
+    }
+
+private:
+    friend class MemoryAllocator;
+
+    MemoryAllocation(MemoryAllocator* allocator,
+                     void* block,
+                     VkDeviceMemory memory,
+                     VkDeviceSize offset,
+                     VkDeviceSize size,
+                     void* mappedData,
+                     MemoryCategory category,
+                     VkDeviceSize blockSize,
+                     VkDeviceSize nonCoherentAtomSize)
+    : allocator_(allocator), block_(block), memory_(memory), offset_(offset), size_(size), mappedData_(mappedData), category_(category),
+    blockSize_(blockSize), nonCoherentAtomSize_(nonCoherentAtomSize) {}
+
+    MemoryAllocator* allocator_;
+    void* block_;
+    VkDeviceMemory memory_;
+    VkDeviceSize offset_;
+    VkDeviceSize size_;
+    void* mappedData_;
+    MemoryCategory category_;
+    VkDeviceSize blockSize_;
+    // Zero for coherent or device only memory
+    VkDeviceSize nonCoherentAtomSize_;
+};
+
+// Collects ranges of non-coherent memory so they are flushed or invalidated with a single call.
+// Ranges of coherent allocations are skipped.
+class MappedRangeBatch {
+public:
+    MappedRangeBatch(VkDevice device) : device_(device) {}
+
+    void add(MemoryAllocation& allocation, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE) {
+        if (!allocation.isCoherent()) {
+            ranges_.push_back(allocation.getMappedRange(offset, size));
+        }
+    }
+
+    // Makes host writes visible to the device
+    VkResult flush() {
+        VkResult result = ranges_.empty() ? VK_SUCCESS : vkFlushMappedMemoryRanges(device_, static_cast<uint32_t>(ranges_.size()), ranges_.data());
+        ranges_.clear();
+        return result;
+    }
+
+    // Makes device writes visible to the host
+    VkResult invalidate() {
+        VkResult result = ranges_.empty() ? VK_SUCCESS : vkInvalidateMappedMemoryRanges(device_, static_cast<uint32_t>(ranges_.size()), ranges_.data());
+        ranges_.clear();
+        return result;
+    }
+
+private:
+    VkDevice device_;
+    std::vector<VkMappedMemoryRange> ranges_;
+};
+
+// Reserves large blocks per memory type and hands out aligned ranges of them,
+// so resources don't each pay for a vkAllocateMemory and count against maxMemoryAllocationCount.
+// Optimal tiling images get their own blocks so bufferImageGranularity never comes into play.
+// Every block and range is reported to the memory budget.
+class MemoryAllocator {
+public:
+    // Smallest range the buddy allocator hands out
+    static constexpr VkDeviceSize MIN_ALLOCATION_SIZE = 256;
+
+    MemoryAllocator(VkDevice device,
+                    VkPhysicalDevice physicalDevice,
+                    MemoryBudget& budget,
+                    VkDeviceSize preferredBlockSize = 64 * 1024 * 1024)
+    : device_(device), physicalDevice_(physicalDevice), budget_(budget) {
+        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties_);
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        nonCoherentAtomSize_ = properties.limits.nonCoherentAtomSize;
+
+        // Host visible device local memory is only worth writing to directly when it covers the whole of VRAM
+        // (resizable BAR, unified memory), not when it is a small window like the classic 256MB BAR
+        VkDeviceSize largestDeviceHeap = 0;
+        for (uint32_t heapIdx = 0; heapIdx < memoryProperties_.memoryHeapCount; ++heapIdx) {
+            if (memoryProperties_.memoryHeaps[heapIdx].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+                largestDeviceHeap = std::max(largestDeviceHeap, memoryProperties_.memoryHeaps[heapIdx].size);
+            }
+        }
+        for (uint32_t typeIdx = 0; typeIdx < memoryProperties_.memoryTypeCount; ++typeIdx) {
+            const VkMemoryPropertyFlags directFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+                | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+            const VkMemoryType& memoryType = memoryProperties_.memoryTypes[typeIdx];
+            if ((memoryType.propertyFlags & directFlags) == directFlags
+                && memoryProperties_.memoryHeaps[memoryType.heapIndex].size >= largestDeviceHeap) {
+                supportsDirectDeviceWrites_ = true;
+            }
+        }
+
+        // Blocks are powers of two for the buddy allocator, and small heaps get smaller blocks
+        for (uint32_t typeIdx = 0; typeIdx < memoryProperties_.memoryTypeCount; ++typeIdx) {
+            VkDeviceSize heapSize = memoryProperties_.memoryHeaps[memoryProperties_.memoryTypes[typeIdx].heapIndex].size;
+            VkDeviceSize blockSize = MIN_ALLOCATION_SIZE;
+            while (blockSize * 2 <= std::min(preferredBlockSize, heapSize / 8)) {
+                blockSize *= 2;
+            }
+            blockSizes_[typeIdx] = blockSize;
+        }
+    }
+
+    // Every allocation has to be freed by then, getHeapStats() reports the live ones
+    ~MemoryAllocator() {
+        assert(std::none_of(blocks_.begin(), blocks_.end(), [](auto& block){ return block->allocationCount > 0; })
+               && "Destroying memory allocator with live allocations");
+    }
+
+    MemoryAllocator(const MemoryAllocator&) = delete;
+    MemoryAllocator& operator=(const MemoryAllocator&) = delete;
+
+    // Whether device local memory can be written by the host without going through a staging buffer
+    bool supportsDirectDeviceWrites() {
+        return supportsDirectDeviceWrites_;
+    }
+
+    // properties are required, preferredProperties only pick between the types that have them
+    VkResult allocate(std::unique_ptr<MemoryAllocation>& outAllocation,
+                      const VkMemoryRequirements& resourceRequirements,
+                      VkMemoryPropertyFlags properties,
+                      MemoryCategory category,
+                      bool optimalImage = false,
+                      VkMemoryPropertyFlags preferredProperties = 0) {
+        auto memoryTypeIndex = VulkanMemory::findMemoryType(physicalDevice_,
+                                                            resourceRequirements.memoryTypeBits,
+                                                            properties,
+                                                            preferredProperties);
+        // None of the types the resource accepts has the required properties
+        if (!memoryTypeIndex.has_value()) {
+            return VK_ERROR_FEATURE_NOT_PRESENT;
+        }
+
+        // Non-coherent ranges are flushed in whole atoms, which must not spill into a neighbour
+        VkMemoryRequirements requirements = resourceRequirements;
+        if (isNonCoherent(memoryTypeIndex.value())) {
+            requirements.alignment = std::max(requirements.alignment, nonCoherentAtomSize_);
+            requirements.size = (requirements.size + nonCoherentAtomSize_ - 1) / nonCoherentAtomSize_ * nonCoherentAtomSize_;
+        }
+
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        VkDeviceSize blockSize = blockSizes_[memoryTypeIndex.value()];
+
+        // Anything that wouldn't leave room for others gets memory of its own
+        if (requirements.size > blockSize / 2) {
+            Block* block;
+            VkResult result = createBlock(block, memoryTypeIndex.value(), requirements.size, optimalImage, true);
+            if (result != VK_SUCCESS) {
+                return result;
+            }
+            block->allocationCount = 1;
+            block->usedBytes = requirements.size;
+            outAllocation = makeAllocation(block, 0, requirements.size, category);
+            return VK_SUCCESS;
+        }
+
+        VkDeviceSize allocationSize = buddySize(requirements);
+        for (auto& block : blocks_) {
+            if (block->dedicated
+                || block->memoryTypeIndex != memoryTypeIndex.value()
+                || block->optimalImage != optimalImage) {
+                continue;
+            }
+            auto offset = allocateFrom(*block, allocationSize);
+            if (offset.has_value()) {
+                outAllocation = makeAllocation(block.get(), offset.value(), allocationSize, category);
+                return VK_SUCCESS;
+            }
+        }
+
+        Block* block;
+        VkResult result = createBlock(block, memoryTypeIndex.value(), blockSize, optimalImage, false);
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+        auto offset = allocateFrom(*block, allocationSize);
+        outAllocation = makeAllocation(block, offset.value(), allocationSize, category);
+        return VK_SUCCESS;
+    }
+
+    // Indexed by memory heap
+    std::vector<HeapStats> getHeapStats() {
+        std::vector<HeapStats> stats(memoryProperties_.memoryHeapCount, HeapStats{});
+        for (uint32_t heapIdx = 0; heapIdx < memoryProperties_.memoryHeapCount; ++heapIdx) {
+            stats[heapIdx].heapSize = memoryProperties_.memoryHeaps[heapIdx].size;
+        }
+
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        for (auto& block : blocks_) {
+            auto& heap = stats[memoryProperties_.memoryTypes[block->memoryTypeIndex].heapIndex];
+            heap.reservedBytes += block->size;
+            heap.usedBytes += block->usedBytes;
+            heap.blockCount += 1;
+            heap.allocationCount += block->allocationCount;
+        }
+        return stats;
+    }
+
+private:
+    friend class MemoryAllocation;
+
+    struct Block {
+        std::unique_ptr<VulkanMemory> memory;
+        void* mappedData = nullptr;
+        VkDeviceSize size;
+        uint32_t memoryTypeIndex;
+        bool optimalImage;
+        bool dedicated;
+
+        // Buddy state, free offsets per order where order 0 is MIN_ALLOCATION_SIZE
+        std::vector<std::set<VkDeviceSize>> freeOffsets;
+
+        VkDeviceSize usedBytes = 0;
+        uint32_t allocationCount = 0;
+    };
+
+    VkResult createBlock(Block*& outBlock,
+                         uint32_t memoryTypeIndex,
+                         VkDeviceSize size,
+                         bool optimalImage,
+                         bool dedicated) {
+        auto block = std::make_unique<Block>();
+        block->size = size;
+        block->memoryTypeIndex = memoryTypeIndex;
+        block->optimalImage = optimalImage;
+        block->dedicated = dedicated;
+
+        VkMemoryAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = size;
+        allocInfo.memoryTypeIndex = memoryTypeIndex;
+        // Streaming gets a chance to evict before the heap goes over budget, and once more if the allocation fails anyway
+        budget_.reserve(memoryTypeIndex, size);
+        VkResult result = VulkanMemory::create(block->memory, device_, allocInfo);
+        if (result == VK_ERROR_OUT_OF_DEVICE_MEMORY && budget_.onAllocationFailed(memoryTypeIndex, size)) {
+            result = VulkanMemory::create(block->memory, device_, allocInfo);
+        }
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+
+        // Host visible blocks stay mapped for their whole life
+        if (memoryProperties_.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+            result = vkMapMemory(device_, **block->memory, 0, VK_WHOLE_SIZE, 0, &block->mappedData);
+            if (result != VK_SUCCESS) {
+                return result;
+            }
+        }
+        // Only once nothing can fail anymore, the memory is freed with the block otherwise
+        budget_.recordDeviceAllocation(memoryTypeIndex, size);
+
+        if (!dedicated) {
+            block->freeOffsets.resize(orderOf(size) + 1);
+            block->freeOffsets.back().insert(0);
+        }
+
+        outBlock = block.get();
+        blocks_.push_back(std::move(block));
+        return VK_SUCCESS;
+    }
+
+    std::unique_ptr<MemoryAllocation> makeAllocation(Block* block, VkDeviceSize offset, VkDeviceSize size, MemoryCategory category) {
+        budget_.recordResourceAllocation(block->memoryTypeIndex, category, size);
+        void* mappedData = block->mappedData ? static_cast<char*>(block->mappedData) + offset : nullptr;
+        return std::unique_ptr<MemoryAllocation>(new MemoryAllocation(this, block, **block->memory, offset, size, mappedData, category,
+                                                                      block->size,
+                                                                      isNonCoherent(block->memoryTypeIndex) ? nonCoherentAtomSize_ : 0));
+    }
+
+    bool isNonCoherent(uint32_t memoryTypeIndex) {
+        VkMemoryPropertyFlags flags = memoryProperties_.memoryTypes[memoryTypeIndex].propertyFlags;
+        return (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) && !(flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    }
+
+    // Buddy ranges are aligned to their size, so asking for at least the alignment covers it
+    static VkDeviceSize buddySize(const VkMemoryRequirements& requirements) {
+        VkDeviceSize size = MIN_ALLOCATION_SIZE;
+        while (size < std::max(requirements.size, requirements.alignment)) {
+            size *= 2;
+        }
+        return size;
+    }
+
+    static uint32_t orderOf(VkDeviceSize size) {
+        uint32_t order = 0;
+        while ((MIN_ALLOCATION_SIZE << order) < size) {
+            ++order;
+        }
+        return order;
+    }
+
+    std::optional<VkDeviceSize> allocateFrom(Block& block, VkDeviceSize size) {
+        auto offset = allocateBuddy(block, orderOf(size));
+        if (offset.has_value()) {
+            block.usedBytes += size;
+            block.allocationCount += 1;
+        }
+        return offset;
+    }
+
+    std::optional<VkDeviceSize> allocateBuddy(Block& block, uint32_t order) {
+        // Smallest free range that fits, split down to the requested order
+        uint32_t freeOrder = order;
+        while (freeOrder < block.freeOffsets.size() && block.freeOffsets[freeOrder].empty()) {
+            ++freeOrder;
+        }
+        if (freeOrder >= block.freeOffsets.size()) {
+            return {};
+        }
+        VkDeviceSize offset = *block.freeOffsets[freeOrder].begin();
+        block.freeOffsets[freeOrder].erase(block.freeOffsets[freeOrder].begin());
+        while (freeOrder > order) {
+            --freeOrder;
+            block.freeOffsets[freeOrder].insert(offset + (MIN_ALLOCATION_SIZE << freeOrder));
+        }
+        return offset;
+    }
+
+    void free(MemoryAllocation& allocation) {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        auto* block = static_cast<Block*>(allocation.block_);
+        budget_.recordResourceFree(block->memoryTypeIndex, allocation.category_, allocation.size_);
+        block->usedBytes -= allocation.size_;
+        block->allocationCount -= 1;
+
+        if (!block->dedicated) {
+            // Merge with the buddy for as long as it is free too
+            VkDeviceSize offset = allocation.offset_;
+            uint32_t order = orderOf(allocation.size_);
+            while (order + 1 < block->freeOffsets.size()) {
+                VkDeviceSize buddy = offset ^ (MIN_ALLOCATION_SIZE << order);
+                auto buddyIt = block->freeOffsets[order].find(buddy);
+                if (buddyIt == block->freeOffsets[order].end()) {
+                    break;
+                }
+                block->freeOffsets[order].erase(buddyIt);
+                offset = std::min(offset, buddy);
+                ++order;
+            }
+            block->freeOffsets[order].insert(offset);
+        }
+
+        if (block->allocationCount == 0) {
+            releaseIfSpare(block);
+        }
+    }
+
+    // Empty blocks are kept as long as they are the only one of their kind, to avoid reallocating in a loop
+    void releaseIfSpare(Block* block) {
+        bool spare = block->dedicated || std::any_of(blocks_.begin(), blocks_.end(), [block](const auto& other){
+            return other.get() != block
+                && !other->dedicated
+                && other->memoryTypeIndex == block->memoryTypeIndex
+                && other->optimalImage == block->optimalImage;
+        });
+        if (!spare) {
+            return;
+        }
+        if (block->mappedData) {
+            vkUnmapMemory(device_, **block->memory);
+        }
+        budget_.recordDeviceFree(block->memoryTypeIndex, block->size);
+        blocks_.erase(std::find_if(blocks_.begin(), blocks_.end(), [block](const auto& other){
+            return other.get() == block;
+        }));
+    }
+
+private:
+    VkDevice device_;
+    VkPhysicalDevice physicalDevice_;
+    MemoryBudget& budget_;
+    VkPhysicalDeviceMemoryProperties memoryProperties_;
+    VkDeviceSize nonCoherentAtomSize_;
+    bool supportsDirectDeviceWrites_ = false;
+    std::array<VkDeviceSize, VK_MAX_MEMORY_TYPES> blockSizes_{};
+
+    // Recursive so the budget callback can free allocations while a block is being allocated
+    std::recursive_mutex mutex_;
+    std::vector<std::unique_ptr<Block>> blocks_;
+};
+
+#ifdef VK_WRAP_UTIL_IMPL
+MemoryAllocation::~MemoryAllocation() {
+    allocator_->free(*this);
+}
+#endif
@@ -0,0 +1,192 @@
+#pragma once
+
+#include "VkTypes.h"
+
+#include <array>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// What a range of device memory is used for
+enum MemoryCategory {
+    BUFFER_MEMORY,
+    IMAGE_MEMORY,
+    STAGING_MEMORY,
+    // Aliased render graph resources
+    TRANSIENT_MEMORY,
+    MEMORY_CATEGORY_COUNT
+};
+
+struct HeapBudget {
+    VkDeviceSize heapSize;
+    // How much the process can use before the driver starts paging, a fixed share of the heap without VK_EXT_memory_budget
+    VkDeviceSize budget;
+    // Process wide usage, only our own allocations without VK_EXT_memory_budget
+    VkDeviceSize usage;
+    // Device memory allocated by us, whether or not resources live in it
+    VkDeviceSize allocatedBytes;
+    // Bytes handed out to resources per MemoryCategory
+    std::array<VkDeviceSize, MEMORY_CATEGORY_COUNT> categoryBytes;
+};
+
+// Accounts for every device memory allocation per heap and category, using VK_EXT_memory_budget when the
+// device has it. When an allocation would push a heap past its budget the budget callback is asked to free
+// memory first, so streaming can evict instead of hitting VK_ERROR_OUT_OF_DEVICE_MEMORY.
+class MemoryBudget {
+public:
+    // Asked to release about bytesToFree bytes on the heap, called on the allocating thread
+    using BudgetCallback = std::function<void(uint32_t heapIndex, VkDeviceSize bytesToFree)>;
+
+    // Share of the heap assumed to be available when the driver can't tell
+    static constexpr float FALLBACK_BUDGET_FRACTION = 0.8f;
+
+    MemoryBudget(VkPhysicalDevice physicalDevice,
+                 bool budgetExtensionEnabled,
+                 float pressureThreshold = 0.9f)
+    : physicalDevice_(physicalDevice),
+    budgetExtensionEnabled_(budgetExtensionEnabled),
+    pressureThreshold_(pressureThreshold) {
+        vkGetPhysicalDeviceMemoryProperties(physicalDevice_, &memoryProperties_);
+        heaps_.resize(memoryProperties_.memoryHeapCount, HeapState{});
+        for (uint32_t heapIdx = 0; heapIdx < memoryProperties_.memoryHeapCount; ++heapIdx) {
+            VkDeviceSize heapSize = memoryProperties_.memoryHeaps[heapIdx].size;
+            heaps_[heapIdx].budget = static_cast<VkDeviceSize>(heapSize * FALLBACK_BUDGET_FRACTION);
+        }
+        refresh();
+    }
+
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    void setBudgetCallback(BudgetCallback callback) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        budgetCallback_ = std::move(callback);
+    }
+
+    uint32_t getHeapIndex(uint32_t memoryTypeIndex) {
+        return memoryProperties_.memoryTypes[memoryTypeIndex].heapIndex;
+    }
+
+    // Call before allocating device memory, gives the callback a chance to make room
+    void reserve(uint32_t memoryTypeIndex, VkDeviceSize size) {
+        uint32_t heapIdx = getHeapIndex(memoryTypeIndex);
+        BudgetCallback callback;
+        VkDeviceSize bytesToFree = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            refresh();
+            VkDeviceSize limit = static_cast<VkDeviceSize>(heaps_[heapIdx].budget * pressureThreshold_);
+            VkDeviceSize usage = getUsage(heapIdx);
+            if (usage + size > limit) {
+                callback = budgetCallback_;
+                bytesToFree = usage + size - limit;
+            }
+        }
+        // Called unlocked, evicting records frees
+        if (callback) {
+            callback(heapIdx, bytesToFree);
+        }
+    }
+
+    // Call when a device allocation failed for lack of memory, returns whether retrying is worth it
+    bool onAllocationFailed(uint32_t memoryTypeIndex, VkDeviceSize size) {
+        uint32_t heapIdx = getHeapIndex(memoryTypeIndex);
+        BudgetCallback callback;
+        VkDeviceSize allocatedBefore;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            callback = budgetCallback_;
+            allocatedBefore = heaps_[heapIdx].allocatedBytes;
+        }
+        if (!callback) {
+            return false;
+        }
+        callback(heapIdx, size);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        return heaps_[heapIdx].allocatedBytes < allocatedBefore;
+    }
+
+    void recordDeviceAllocation(uint32_t memoryTypeIndex, VkDeviceSize size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        heaps_[getHeapIndex(memoryTypeIndex)].allocatedBytes += size;
+    }
+
+    void recordDeviceFree(uint32_t memoryTypeIndex, VkDeviceSize size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        heaps_[getHeapIndex(memoryTypeIndex)].allocatedBytes -= size;
+    }
+
+    void recordResourceAllocation(uint32_t memoryTypeIndex, MemoryCategory category, VkDeviceSize size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        heaps_[getHeapIndex(memoryTypeIndex)].categoryBytes[category] += size;
+    }
+
+    void recordResourceFree(uint32_t memoryTypeIndex, MemoryCategory category, VkDeviceSize size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        heaps_[getHeapIndex(memoryTypeIndex)].categoryBytes[category] -= size;
+    }
+
+    // Indexed by memory heap
+    std::vector<HeapBudget> getSnapshot() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        refresh();
+        std::vector<HeapBudget> snapshot(heaps_.size());
+        for (uint32_t heapIdx = 0; heapIdx < heaps_.size(); ++heapIdx) {
+            snapshot[heapIdx].heapSize = memoryProperties_.memoryHeaps[heapIdx].size;
+            snapshot[heapIdx].budget = heaps_[heapIdx].budget;
+            snapshot[heapIdx].usage = getUsage(heapIdx);
+            snapshot[heapIdx].allocatedBytes = heaps_[heapIdx].allocatedBytes;
+            snapshot[heapIdx].categoryBytes = heaps_[heapIdx].categoryBytes;
+        }
+        return snapshot;
+    }
+
+private:
+    struct HeapState {
+        VkDeviceSize budget = 0;
+        // Driver reported usage, and our allocations at the time it was read
+        VkDeviceSize driverUsage = 0;
+        VkDeviceSize allocatedAtRefresh = 0;
+        VkDeviceSize allocatedBytes = 0;
+        std::array<VkDeviceSize, MEMORY_CATEGORY_COUNT> categoryBytes{};
+    };
+
+    void refresh() {
+        if (!budgetExtensionEnabled_) {
+            return;
+        }
+        VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties{};
+        budgetProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+        VkPhysicalDeviceMemoryProperties2 properties{};
+        properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+        properties.pNext = &budgetProperties;
+        vkGetPhysicalDeviceMemoryProperties2(physicalDevice_, &properties);
+
+        for (uint32_t heapIdx = 0; heapIdx < heaps_.size(); ++heapIdx) {
+            heaps_[heapIdx].budget = budgetProperties.heapBudget[heapIdx];
+            heaps_[heapIdx].driverUsage = budgetProperties.heapUsage[heapIdx];
+            heaps_[heapIdx].allocatedAtRefresh = heaps_[heapIdx].allocatedBytes;
+        }
+    }
+
+    VkDeviceSize getUsage(uint32_t heapIdx) {
+        auto& heap = heaps_[heapIdx];
+        if (!budgetExtensionEnabled_) {
+            return heap.allocatedBytes;
+        }
+        // The driver's numbers can lag behind, so account for what changed since they were read
+        VkDeviceSize usage = heap.driverUsage + heap.allocatedBytes;
+        return usage > heap.allocatedAtRefresh ? usage - heap.allocatedAtRefresh : 0;
+    }
+
+private:
+    VkPhysicalDevice physicalDevice_;
+    bool budgetExtensionEnabled_;
+    float pressureThreshold_;
+    VkPhysicalDeviceMemoryProperties memoryProperties_;
+
+    std::mutex mutex_;
+    std::vector<HeapState> heaps_;
+    BudgetCallback budgetCallback_;
+};
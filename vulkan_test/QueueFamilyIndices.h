@@ -7,6 +7,11 @@
 struct QueueFamilyIndices {
     std::optional<uint32_t> graphicsFamily;
     std::optional<uint32_t> presentFamily;
+    // Dedicated compute family when the device has one, so compute can overlap rasterization.
+    // Otherwise the graphics family.
+    std::optional<uint32_t> computeFamily;
+    // Dedicated transfer family (DMA engine) when the device has one, otherwise the graphics family
+    std::optional<uint32_t> transferFamily;
     
     bool complete() {
         return graphicsFamily.has_value() && presentFamily.has_value();
@@ -16,7 +21,10 @@ struct QueueFamilyIndices {
         if (!complete()){
             return {};
         } else {
-            return {graphicsFamily.value(), presentFamily.value()};
+            return {graphicsFamily.value(),
+                    presentFamily.value(),
+                    computeFamily.value_or(graphicsFamily.value()),
+                    transferFamily.value_or(graphicsFamily.value())};
         }
     }
 };
@@ -29,7 +37,7 @@ QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device, VkSurfaceKHR surfa
     
     std::vector<VkQueueFamilyProperties> queueFamilies = readVkVectorVoid<VkQueueFamilyProperties, VkPhysicalDevice>(device, vkGetPhysicalDeviceQueueFamilyProperties);
     for (int i = 0; i < queueFamilies.size(); ++i) {
-        // Also requiring compute queue to avoid having to synchronize dedicated async compute
+        // Also requiring compute queue so compute can fall back to it
         if (queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT
             && queueFamilies[i].queueFlags & VK_QUEUE_COMPUTE_BIT) {
             indices.graphicsFamily = i;
@@ -47,6 +55,24 @@ QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device, VkSurfaceKHR surfa
         }
     }
     
+    indices.computeFamily = indices.graphicsFamily;
+    for (int i = 0; i < queueFamilies.size(); ++i) {
+        if (queueFamilies[i].queueFlags & VK_QUEUE_COMPUTE_BIT
+            && !(queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+            indices.computeFamily = i;
+            break;
+        }
+    }
+    
+    indices.transferFamily = indices.graphicsFamily;
+    for (int i = 0; i < queueFamilies.size(); ++i) {
+        if (queueFamilies[i].queueFlags & VK_QUEUE_TRANSFER_BIT
+            && !(queueFamilies[i].queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+            indices.transferFamily = i;
+            break;
+        }
+    }
+    
     return indices;
 }
 #endif
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "RenderGraph.h"
+
+// Base for GPU nodes that fill a single command buffer per frame.
+// The graph records it on one of its workers, from a command pool owned by
+// that worker, and submits the recorded buffers in dependency order.
+// Beginning and ending the command buffer is left to the graph.
+template<uint MAX_FRAMES>
+class RecordedNode : public RenderNode<MAX_FRAMES> {
+public:
+    NodeDevice getDeviceType() override {
+        return NodeDevice::GPU;
+    }
+
+    void submit(RenderEvalContext& ctx) override {
+        throw std::runtime_error("Recorded nodes are submitted by the render graph");
+    }
+
+protected:
+    RecordedNode<MAX_FRAMES>(VkDevice device,
+                             VkQueue queue,
+                             uint32_t queueFamilyIndex,
+                             VkPipelineStageFlags waitStage)
+    : RenderNode<MAX_FRAMES>(device),
+    queue_(queue),
+    queueFamilyIndex_(queueFamilyIndex),
+    waitStage_(waitStage) {}
+
+    bool supportsTimelineSync() override {
+        return true;
+    }
+
+    bool recordsCommands() override {
+        return true;
+    }
+
+    VkQueue getQueue() override {
+        return queue_;
+    }
+
+    uint32_t getQueueFamilyIndex() override {
+        return queueFamilyIndex_;
+    }
+
+    VkPipelineStageFlags getWaitStage() override {
+        return waitStage_;
+    }
+
+protected:
+    VkQueue queue_;
+    uint32_t queueFamilyIndex_;
+    VkPipelineStageFlags waitStage_;
+};
@@ -2,14 +2,26 @@
 
 #include "VkTypes.h"
 #include "VkUtil.h"
+#include "ThreadPool.h"
+#include "TransientResources.h"
+#include "GpuProfiler.h"
 
-#include <unordered_set>
+#include <sstream>
+#include <unordered_map>
 
 enum NodeDevice {
     GPU,
     CPU
 };
 
+// How the graph synchronizes GPU -> GPU edges and frame blocking
+enum SyncBackend {
+    // One binary semaphore / fence per edge per frame in flight
+    BINARY,
+    // One timeline semaphore per node, waited on with per-frame values (Vulkan 1.2)
+    TIMELINE
+};
+
 struct RenderEvalContext {
     const uint32_t frameIndex;
     const VkExtent2D swapchainExtent;
@@ -17,6 +29,8 @@ struct RenderEvalContext {
     std::vector<VkFramebuffer> frameBuffers;
     VkSwapchainKHR swapChain;
     bool shouldRecreateSwapChain;
+    // Value every timeline semaphore is signalled to this frame
+    uint64_t timelineValue = 0;
 };
 
 template<uint MAX_FRAMES>
@@ -32,6 +46,48 @@ public:
 
 protected:
     virtual NodeDevice getDeviceType() = 0;
+    
+    // Nodes whose command buffers the graph submits can take part in timeline sync.
+    // Swapchain acquire / present only accept binary semaphores.
+    virtual bool supportsTimelineSync() {
+        return false;
+    }
+    
+    // Nodes that run their work asynchronously on the graph's thread pool
+    // can be the source of CPU -> CPU and CPU -> GPU edges
+    virtual bool supportsCpuEdges() {
+        return false;
+    }
+    
+    // Called on every node before the graph starts submitting a frame, on the thread driving the graph.
+    // Recorded nodes update the state their record() reads here.
+    virtual void prepareFrame(const RenderEvalContext& ctx) {}
+    
+    // Blocks until any CPU work this node kicked off for the frame has finished
+    virtual void waitForCpuWork(uint32_t frameIndex) {}
+    
+    // Nodes that record a command buffer have it recorded on one of the graph's
+    // workers, the graph then submits the recorded buffers in dependency order
+    virtual bool recordsCommands() {
+        return false;
+    }
+    
+    virtual VkQueue getQueue() {
+        return VK_NULL_HANDLE;
+    }
+    
+    virtual uint32_t getQueueFamilyIndex() {
+        return 0;
+    }
+    
+    // Stage that waits on the node's incoming semaphores
+    virtual VkPipelineStageFlags getWaitStage() {
+        return VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    }
+    
+    // Called on a worker thread, concurrently with other nodes' recording, which may share materials.
+    // Only read shared state here. The command buffer has already been begun and is ended by the graph.
+    virtual void record(const RenderEvalContext& ctx, VkCommandBuffer commandBuffer) {}
 
     RenderNode<MAX_FRAMES>(VkDevice device) : device_(device) {
         // Initialize signal objects to VK_NULL_HANDLE
@@ -52,15 +108,13 @@ protected:
             }
         }
         
-        other->addSemaphoreWait(unwrap<VkSemaphore, VulkanSemaphore>(signalSemaphores_), this);
-        children_.push_back(other);
+        other->addSemaphoreWait(unwrap<VkSemaphore, VulkanSemaphore>(signalSemaphores_));
     }
     
-    void addSemaphoreWait(std::array<VkSemaphore, MAX_FRAMES> semaphore, RenderNode<MAX_FRAMES>* parent) {
+    void addSemaphoreWait(std::array<VkSemaphore, MAX_FRAMES> semaphore) {
         for (uint idx = 0; idx < MAX_FRAMES; ++idx) {
             waitSemaphores_[idx].push_back(semaphore[idx]);
         }
-        parents_.push_back(parent);
     }
     
     void addFenceEdgeTo(RenderNode<MAX_FRAMES>* other, bool createSignaled = false) {
@@ -76,28 +130,101 @@ protected:
             }
         }
         
-        other->addFenceWait(unwrap<VkFence, VulkanFence>(signalFences_), this);
-        children_.push_back(other);
+        other->addFenceWait(unwrap<VkFence, VulkanFence>(signalFences_));
     }
     
-    void addFenceWait(std::array<VkFence, MAX_FRAMES> fence, RenderNode<MAX_FRAMES>* parent) {
+    void addFenceWait(std::array<VkFence, MAX_FRAMES> fence) {
         for (uint idx = 0; idx < MAX_FRAMES; ++idx) {
             waitFences_[idx].push_back(fence[idx]);
         }
-        parents_.push_back(parent);
     }
     
-    const std::vector<RenderNode<MAX_FRAMES>*> getChildren() {
-        return children_;
+    void addTimelineEdgeTo(RenderNode<MAX_FRAMES>* other) {
+        // If this is our first outgoing edge, initialize our timeline
+        if (!timeline_) {
+            VK_SUCCESS_OR_THROW(VulkanSemaphore::createTimeline(timeline_, device_),
+                                "Failed to create timeline semaphore");
+        }
+        
+        other->waitTimelines_.push_back(**timeline_);
     }
-
-    bool allParentsVisited(const std::unordered_set<RenderNode<MAX_FRAMES>*>& visited) {
-        for (auto parent : parents_) {
-            if (visited.find(parent) == visited.end()) {
-                return false;
+    
+    void addCpuEdgeTo(RenderNode<MAX_FRAMES>* other) {
+        cpuChildren_.push_back(other);
+        ++other->cpuParentCount_;
+    }
+    
+    // Drops the wait lists so they can be rebuilt by the graph compiler.
+    // Signal objects are kept since they may still be in flight.
+    void clearWaits() {
+        for (uint idx = 0; idx < MAX_FRAMES; ++idx) {
+            waitSemaphores_[idx].clear();
+            waitFences_[idx].clear();
+        }
+        waitTimelines_.clear();
+        cpuChildren_.clear();
+        cpuParentCount_ = 0;
+    }
+    
+    // Flattens the binary and timeline wait / signal lists into the arrays
+    // handed to vkQueueSubmit, so submitting doesn't allocate
+    void buildSubmitSync() {
+        for (uint frameIdx = 0; frameIdx < MAX_FRAMES; ++frameIdx) {
+            auto& sync = submitSync_[frameIdx];
+            
+            sync.waitSemaphores = waitSemaphores_[frameIdx];
+            sync.waitSemaphores.insert(sync.waitSemaphores.end(), waitTimelines_.begin(), waitTimelines_.end());
+            // Values for binary semaphores are ignored
+            sync.waitValues.assign(sync.waitSemaphores.size(), 0);
+            sync.waitStages.assign(sync.waitSemaphores.size(), 0);
+            
+            sync.signalSemaphores.clear();
+            if (**signalSemaphores_[frameIdx] != VK_NULL_HANDLE) {
+                sync.signalSemaphores.push_back(**signalSemaphores_[frameIdx]);
             }
+            if (timeline_) {
+                sync.signalSemaphores.push_back(**timeline_);
+            }
+            sync.signalValues.assign(sync.signalSemaphores.size(), 0);
+        }
+    }
+    
+    // Builds the submit info for a recorded command buffer, waiting on and signalling
+    // whatever sync objects the graph compiler wired up for this node.
+    // Everything it points to is owned by the node, so the graph can batch it with others.
+    VkSubmitInfo prepareSubmit(VkCommandBuffer commandBuffer,
+                               VkPipelineStageFlags waitStage,
+                               const RenderEvalContext& ctx) {
+        auto& sync = submitSync_[ctx.frameIndex];
+        sync.commandBuffer = commandBuffer;
+        
+        // Timelines always trail the binary semaphores
+        std::fill(sync.waitStages.begin(), sync.waitStages.end(), waitStage);
+        std::fill(sync.waitValues.begin() + waitSemaphores_[ctx.frameIndex].size(), sync.waitValues.end(), ctx.timelineValue);
+        if (timeline_) {
+            sync.signalValues.back() = ctx.timelineValue;
         }
-        return true;
+        
+        auto& timelineInfo = sync.timelineInfo;
+        timelineInfo = {};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.waitSemaphoreValueCount = static_cast<uint32_t>(sync.waitValues.size());
+        timelineInfo.pWaitSemaphoreValues = sync.waitValues.data();
+        timelineInfo.signalSemaphoreValueCount = static_cast<uint32_t>(sync.signalValues.size());
+        timelineInfo.pSignalSemaphoreValues = sync.signalValues.data();
+        
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.pNext = (timeline_ || !waitTimelines_.empty()) ? &timelineInfo : nullptr;
+        // Without a command buffer the submit still waits and signals, so nothing downstream hangs
+        submitInfo.commandBufferCount = commandBuffer != VK_NULL_HANDLE ? 1 : 0;
+        submitInfo.pCommandBuffers = &sync.commandBuffer;
+        submitInfo.waitSemaphoreCount = static_cast<uint32_t>(sync.waitSemaphores.size());
+        submitInfo.pWaitSemaphores = sync.waitSemaphores.data();
+        submitInfo.pWaitDstStageMask = sync.waitStages.data();
+        submitInfo.signalSemaphoreCount = static_cast<uint32_t>(sync.signalSemaphores.size());
+        submitInfo.pSignalSemaphores = sync.signalSemaphores.data();
+        return submitInfo;
     }
     
 private:
@@ -112,14 +239,28 @@ private:
     
 protected:
     VkDevice device_;
-    std::vector<RenderNode<MAX_FRAMES>*> children_;
     std::array<std::unique_ptr<VulkanSemaphore>, MAX_FRAMES> signalSemaphores_;
     std::array<std::vector<VkSemaphore>, MAX_FRAMES> waitSemaphores_;
     std::array<std::unique_ptr<VulkanFence>, MAX_FRAMES> signalFences_;
     std::array<std::vector<VkFence>, MAX_FRAMES> waitFences_;
+    std::unique_ptr<VulkanSemaphore> timeline_;
+    std::vector<VkSemaphore> waitTimelines_;
+    std::vector<RenderNode<MAX_FRAMES>*> cpuChildren_;
+    uint32_t cpuParentCount_ = 0;
+    // Owned by the graph, set when it is compiled
+    ThreadPool* threadPool_ = nullptr;
 
 private:
-    std::vector<RenderNode<MAX_FRAMES>*> parents_;
+    struct SubmitSync {
+        std::vector<VkSemaphore> waitSemaphores;
+        std::vector<uint64_t> waitValues;
+        std::vector<VkPipelineStageFlags> waitStages;
+        std::vector<VkSemaphore> signalSemaphores;
+        std::vector<uint64_t> signalValues;
+        VkTimelineSemaphoreSubmitInfo timelineInfo;
+        VkCommandBuffer commandBuffer;
+    };
+    std::array<SubmitSync, MAX_FRAMES> submitSync_;
 };
 
 template<uint MAX_FRAMES>
@@ -127,7 +268,16 @@ class RenderGraph : public RenderNode<MAX_FRAMES> {
 public:
     using NodeHandle = uint32_t;
     
-    RenderGraph<MAX_FRAMES>(VkDevice device): RenderNode<MAX_FRAMES>(device) {}
+    using ResourceHandle = typename TransientResources<MAX_FRAMES>::ResourceHandle;
+    
+    RenderGraph<MAX_FRAMES>(VkDevice device,
+                            VkPhysicalDevice physicalDevice,
+                            SyncBackend syncBackend = SyncBackend::BINARY,
+                            MemoryBudget* memoryBudget = nullptr)
+    : RenderNode<MAX_FRAMES>(device),
+    syncBackend_(syncBackend),
+    transientResources_(device, physicalDevice, memoryBudget),
+    profiler_(device, physicalDevice) {}
     
     NodeDevice getDeviceType() override {
         return NodeDevice::CPU;
@@ -135,103 +285,513 @@ public:
     
     NodeHandle addNode(std::unique_ptr<RenderNode<MAX_FRAMES>>&& node) {
         nodes_.emplace_back(std::move(node));
-        startNodes_.emplace_back(true);
+        compiled_ = false;
         return static_cast<NodeHandle>(nodes_.size() - 1);
     }
     
     int addEdge(NodeHandle from, NodeHandle to) {
-        startNodes_[to] = false;
-        if (nodes_.at(from)->getDeviceType() == NodeDevice::GPU) {
-            if (nodes_.at(to)->getDeviceType() == NodeDevice::GPU) {
-                // Semaphore case
-                nodes_.at(from)->addSemaphoreEdgeTo(nodes_.at(to).get());
-            } else if (nodes_.at(to)->getDeviceType() == NodeDevice::CPU) {
-                // Fence case
-                nodes_.at(from)->addFenceEdgeTo(nodes_.at(to).get());
-            }
-        } else if (nodes_.at(from)->getDeviceType() == NodeDevice::CPU) {
-            if (nodes_.at(to)->getDeviceType() == NodeDevice::GPU) {
-                // TODO CPU -> GPU ???
-                return EXIT_FAILURE;
-            } else if (nodes_.at(to)->getDeviceType() == NodeDevice::CPU) {
-                // TODO CPU -> CPU ??
+        if (from >= nodes_.size() || to >= nodes_.size() || from == to) {
+            return EXIT_FAILURE;
+        }
+        bool duplicate = std::any_of(edges_.begin(), edges_.end(), [&](const Edge& edge){
+            return edge.from == from && edge.to == to;
+        });
+        if (duplicate) {
+            return EXIT_FAILURE;
+        }
+        auto* fromNode = nodes_[from].get();
+        auto* toNode = nodes_[to].get();
+        if (fromNode->getDeviceType() == NodeDevice::CPU) {
+            // Only nodes running on the thread pool can gate other nodes from the CPU
+            if (!fromNode->supportsCpuEdges() ||
+                (toNode->getDeviceType() == NodeDevice::CPU && !toNode->supportsCpuEdges())) {
                 return EXIT_FAILURE;
             }
         }
+        
+        edges_.push_back({from, to});
+        compiled_ = false;
         return 0;
     }
     
     // Marks a node as needing to be completed before
-    // starting the next frame
+    // starting the next frame. Recorded nodes always are, since their command pools get reset.
     int flagNodeAsFrameBlocking(NodeHandle node) {
-        if (nodes_[node]->getDeviceType() == NodeDevice::GPU) {
-            nodes_[node]->addFenceEdgeTo(this, true /* createSignaled */);
-        } else {
-            // CPU -> CPU sync not supported yet
-            return EXIT_FAILURE;
+        if (nodes_.at(node)->getDeviceType() != NodeDevice::GPU) {
+            // CPU work is always waited on in waitUntilComplete
+            return nodes_[node]->supportsCpuEdges() ? 0 : EXIT_FAILURE;
         }
         
+        frameBlockingNodes_.push_back(node);
+        compiled_ = false;
         return 0;
     }
     
+    // Transient resources are allocated when the graph is compiled, so
+    // their handles are only valid after that. Bind them to descriptors instead.
+    ResourceHandle createTransientImage(const TransientImageInfo& info) {
+        compiled_ = false;
+        return transientResources_.addImage(info);
+    }
+    
+    ResourceHandle createTransientBuffer(const TransientBufferInfo& info) {
+        compiled_ = false;
+        return transientResources_.addBuffer(info);
+    }
+    
+    // Declares how a recorded node touches a transient resource, and in which pipeline stages.
+    // The graph transitions images at the start of the node's command buffer when
+    // the layout changes, moves ownership between queue families when the previous
+    // user ran on another one, and makes its parents' semaphores wait on those stages.
+    // A node may declare several accesses to a resource as long as they share a layout.
+    int addResourceUse(NodeHandle node, ResourceHandle resource, ResourceAccess access, VkPipelineStageFlags stages) {
+        if (node >= nodes_.size() || !nodes_[node]->recordsCommands()) {
+            return EXIT_FAILURE;
+        }
+        compiled_ = false;
+        return transientResources_.addUse(resource, node, nodes_[node]->getQueueFamilyIndex(), access, stages);
+    }
+    
+    int bindImageDescriptor(ResourceHandle resource, std::shared_ptr<ImageDescriptor<MAX_FRAMES>> descriptor) {
+        return transientResources_.bindImageDescriptor(resource, descriptor);
+    }
+    
+    template<typename Data>
+    int bindBufferDescriptor(ResourceHandle resource, std::shared_ptr<BufferDescriptor<Data, MAX_FRAMES>> descriptor) {
+        return transientResources_.bindBufferDescriptor(resource, descriptor);
+    }
+    
+    TransientResources<MAX_FRAMES>& getTransientResources() {
+        return transientResources_;
+    }
+    
+    // Validates the graph and caches a flat submission order along with
+    // each node's wait lists. Called lazily by submit after the graph changes.
+    void compile() {
+        // Kahn's algorithm, visiting start nodes in the order they were added
+        std::vector<std::vector<NodeHandle>> children(nodes_.size());
+        std::vector<uint32_t> inDegree(nodes_.size(), 0);
+        for (const auto& edge : edges_) {
+            children[edge.from].push_back(edge.to);
+            ++inDegree[edge.to];
+        }
+        
+        std::vector<NodeHandle> order;
+        order.reserve(nodes_.size());
+        for (NodeHandle handle = 0; handle < nodes_.size(); ++handle) {
+            if (inDegree[handle] == 0) {
+                order.push_back(handle);
+            }
+        }
+        for (size_t head = 0; head < order.size(); ++head) {
+            for (NodeHandle child : children[order[head]]) {
+                if (--inDegree[child] == 0) {
+                    order.push_back(child);
+                }
+            }
+        }
+        
+        // Anything left over sits on (or behind) a cycle and can never run
+        if (order.size() != nodes_.size()) {
+            std::stringstream err;
+            err << "RenderGraph contains a cycle, unreachable nodes:";
+            for (NodeHandle handle = 0; handle < nodes_.size(); ++handle) {
+                if (inDegree[handle] != 0) {
+                    err << " " << handle;
+                }
+            }
+            throw std::runtime_error(err.str());
+        }
+        
+        // Which nodes are guaranteed to run after each node, walking the order backwards
+        std::vector<std::vector<bool>> reachable(nodes_.size(), std::vector<bool>(nodes_.size(), false));
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            for (NodeHandle child : children[*it]) {
+                reachable[*it][child] = true;
+                for (NodeHandle handle = 0; handle < nodes_.size(); ++handle) {
+                    if (reachable[child][handle]) {
+                        reachable[*it][handle] = true;
+                    }
+                }
+            }
+        }
+        
+        // Jobs still in flight read the wait lists we're about to rebuild
+        for (uint frameIdx = 0; frameIdx < MAX_FRAMES; ++frameIdx) {
+            for (auto& node : nodes_) {
+                node->waitForCpuWork(frameIdx);
+            }
+        }
+        
+        bool hasWorkerJobs = std::any_of(nodes_.begin(), nodes_.end(), [](const auto& node){
+            return node->supportsCpuEdges() || node->recordsCommands();
+        });
+        if (hasWorkerJobs && !workerPool_) {
+            workerPool_ = std::make_unique<ThreadPool>();
+            recordingPools_.resize(workerPool_->getThreadCount());
+        }
+        
+        // Rebuild the wait lists from scratch
+        RenderNode<MAX_FRAMES>::clearWaits();
+        for (auto& node : nodes_) {
+            node->clearWaits();
+            node->threadPool_ = workerPool_.get();
+        }
+        // Recorded nodes no frame blocking node waits on are waited on directly,
+        // their command buffers are recycled when the frame slot comes around again
+        std::vector<NodeHandle> blockingNodes = frameBlockingNodes_;
+        for (NodeHandle handle = 0; handle < nodes_.size(); ++handle) {
+            bool waitedOn = std::any_of(frameBlockingNodes_.begin(), frameBlockingNodes_.end(), [&](NodeHandle blocking){
+                return blocking == handle || reachable[handle][blocking];
+            });
+            if (nodes_[handle]->recordsCommands() && !waitedOn) {
+                blockingNodes.push_back(handle);
+            }
+        }
+        // Frame blocking fences go first so they get created signaled
+        for (NodeHandle handle : blockingNodes) {
+            if (useTimeline(nodes_[handle].get())) {
+                nodes_[handle]->addTimelineEdgeTo(this);
+            } else {
+                nodes_[handle]->addFenceEdgeTo(this, true /* createSignaled */);
+            }
+        }
+        std::vector<std::vector<RenderNode<MAX_FRAMES>*>> cpuParents(nodes_.size());
+        std::vector<bool> hasRecordedParent(nodes_.size(), false);
+        std::vector<bool> signalsSemaphore(nodes_.size(), false);
+        for (const auto& edge : edges_) {
+            auto* from = nodes_[edge.from].get();
+            auto* to = nodes_[edge.to].get();
+            hasRecordedParent[edge.to] = hasRecordedParent[edge.to] || from->recordsCommands();
+            if (from->getDeviceType() == NodeDevice::CPU) {
+                if (to->getDeviceType() == NodeDevice::CPU) {
+                    // Plain dependency, the parent's job releases the child's
+                    from->addCpuEdgeTo(to);
+                } else {
+                    // The graph holds back the GPU submit until the job is done
+                    cpuParents[edge.to].push_back(from);
+                }
+            } else if (to->getDeviceType() == NodeDevice::GPU) {
+                if (useTimeline(from) && useTimeline(to)) {
+                    // Timeline case
+                    from->addTimelineEdgeTo(to);
+                } else {
+                    // Semaphore case, a binary signal only satisfies a single wait
+                    if (signalsSemaphore[edge.from]) {
+                        std::stringstream err;
+                        err << "Node " << edge.from << " can't signal more than one GPU child through a binary semaphore";
+                        throw std::runtime_error(err.str());
+                    }
+                    signalsSemaphore[edge.from] = true;
+                    from->addSemaphoreEdgeTo(to);
+                }
+            } else {
+                // Fence case
+                from->addFenceEdgeTo(to);
+            }
+        }
+        for (auto& node : nodes_) {
+            node->buildSubmitSync();
+        }
+        frameWaitValues_.assign(RenderNode<MAX_FRAMES>::waitTimelines_.size(), 0);
+        
+        if (!transientResources_.isAllocated()) {
+            transientResources_.allocate(reachable);
+        }
+        transientResources_.planBarriers(order, reachable);
+        
+        std::vector<std::optional<uint32_t>> profiledFamilies(nodes_.size());
+        for (NodeHandle handle = 0; handle < nodes_.size(); ++handle) {
+            if (nodes_[handle]->recordsCommands()) {
+                profiledFamilies[handle] = nodes_[handle]->getQueueFamilyIndex();
+            }
+        }
+        profiler_.assignQueries(profiledFamilies);
+        
+        schedule_.clear();
+        for (NodeHandle handle : order) {
+            auto* node = nodes_[handle].get();
+            // Nodes submitting on their own need recorded parents to have reached the queue first
+            bool flushBefore = !node->recordsCommands() && hasRecordedParent[handle];
+            schedule_.push_back({handle, node, std::move(cpuParents[handle]), flushBefore});
+        }
+        compiled_ = true;
+    }
+    
     void waitUntilComplete(uint32_t frameIndex) {
-        // Wait for the previous frame to finish
+        // Wait for the previous frame to finish, rethrowing what its CPU jobs threw
+        for (auto& node : nodes_) {
+            node->waitForCpuWork(frameIndex);
+        }
+        if (workerPool_) {
+            workerPool_->rethrowJobError();
+        }
+        
         auto& fences = RenderNode<MAX_FRAMES>::waitFences_[frameIndex];
-        for (uint idx = 0; idx < fences.size(); ++idx) {
-            vkWaitForFences(RenderNode<MAX_FRAMES>::device_, 1, &fences[idx], VK_TRUE, UINT64_MAX);
+        if (!fences.empty()) {
+            vkWaitForFences(RenderNode<MAX_FRAMES>::device_,
+                            static_cast<uint32_t>(fences.size()), fences.data(),
+                            VK_TRUE, UINT64_MAX);
+        }
+        
+        // Every frame blocking timeline reaches the value of the last frame submitted in this slot
+        auto& timelines = RenderNode<MAX_FRAMES>::waitTimelines_;
+        if (!timelines.empty()) {
+            std::fill(frameWaitValues_.begin(), frameWaitValues_.end(), frameTimelineValues_[frameIndex]);
+            
+            VkSemaphoreWaitInfo waitInfo{};
+            waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+            waitInfo.semaphoreCount = static_cast<uint32_t>(timelines.size());
+            waitInfo.pSemaphores = timelines.data();
+            waitInfo.pValues = frameWaitValues_.data();
+            vkWaitSemaphores(RenderNode<MAX_FRAMES>::device_, &waitInfo, UINT64_MAX);
         }
     }
     
     void submit(RenderEvalContext& ctx) override {
-        // Reset our fences
-        for (VkFence& fence : RenderNode<MAX_FRAMES>::waitFences_[ctx.frameIndex]) {
-            vkResetFences(RenderNode<MAX_FRAMES>::device_, 1, &fence);
+        if (!compiled_) {
+            compile();
+        }
+        
+        submitCount_ = 0;
+        
+        // Advance the timeline, every node signals this value once its work is done
+        ctx.timelineValue = ++timelineValue_;
+        frameTimelineValues_[ctx.frameIndex] = timelineValue_;
+        
+        // Every recorded node of the frame that last used this slot has completed, so its command buffers can be recycled
+        resetRecordingPools(ctx.frameIndex);
+        profiler_.collect(ctx.frameIndex);
+        for (auto& node : nodes_) {
+            node->prepareFrame(ctx);
         }
         
-        // Initialize the queue with all nodes without an incoming edge
-        std::queue<RenderNode<MAX_FRAMES>*> nodeQueue;
-        for (uint idx = 0; idx < nodes_.size(); ++idx) {
-            if (startNodes_[idx]) {
-                nodeQueue.push(nodes_.at(idx).get());
+        // Kick off each node's work in dependency order
+        for (auto& entry : schedule_) {
+            for (auto* parent : entry.cpuParents) {
+                parent->waitForCpuWork(ctx.frameIndex);
+            }
+            if (entry.flushBefore) {
+                submitRecorded(ctx);
+            }
+            if (entry.node->recordsCommands()) {
+                startRecording(entry, ctx);
+            } else {
+                entry.node->submit(ctx);
             }
         }
-        // Keep track of nodes that have been visited
-        std::unordered_set<RenderNode<MAX_FRAMES>*> visited;
-        visited.emplace(this);
-
-        // Traverse the graph submitting work as we go
-        while(nodeQueue.size() != 0) {
-            // Grab the next node from the queue
-            auto* node = nodeQueue.front();
-            nodeQueue.pop();
-
-            // If this node's parents haven't been submitted,
-            // move it to the back of the queue
-            if (!node->allParentsVisited(visited)) {
-                nodeQueue.push(node);
-                continue;
+        submitRecorded(ctx);
+        
+        // The rest of the frame went out regardless, so the next one finds every fence and semaphore settled
+        if (frameError_) {
+            auto error = frameError_;
+            frameError_ = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+    
+    // Number of vkQueueSubmit calls the graph made for the last frame
+    uint32_t getSubmitCount() {
+        return submitCount_;
+    }
+    
+    // GPU time spent in a recorded node's command buffer over the last frames.
+    // Results lag MAX_FRAMES behind, nodes on queues without timestamp support report no samples.
+    NodeTimingStats getNodeTimings(NodeHandle node) {
+        return profiler_.getStats(node);
+    }
+    
+private:
+    bool useTimeline(RenderNode<MAX_FRAMES>* node) {
+        return syncBackend_ == SyncBackend::TIMELINE && node->supportsTimelineSync();
+    }
+    
+    struct ScheduledNode;
+    
+    void startRecording(ScheduledNode& entry, const RenderEvalContext& ctx) {
+        recordedNodes_.push_back(&entry);
+        entry.commandBuffer = VK_NULL_HANDLE;
+        entry.profiled = false;
+        // Once a recording failed the frame is dropped, later nodes go out empty
+        if (frameError_) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(recordingMutex_);
+            ++pendingRecordings_;
+        }
+        
+        bool profiled = profiler_.beginFrameForNode(entry.handle, ctx.frameIndex);
+        entry.profiled = profiled;
+        workerPool_->submit([this, &entry, &ctx, profiled](){
+            try {
+                auto commandBuffer = nextCommandBuffer(ctx.frameIndex, entry.node->getQueueFamilyIndex());
+                VkCommandBufferBeginInfo beginInfo{};
+                beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+                beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+                VK_SUCCESS_OR_THROW(vkBeginCommandBuffer(commandBuffer, &beginInfo),
+                                    "Failed to begin recording command buffer");
+                
+                if (profiled) {
+                    profiler_.recordBegin(entry.handle, ctx.frameIndex, commandBuffer);
+                }
+                transientResources_.recordBarriersBefore(entry.handle, ctx.frameIndex, commandBuffer);
+                entry.node->record(ctx, commandBuffer);
+                transientResources_.recordBarriersAfter(entry.handle, ctx.frameIndex, commandBuffer);
+                if (profiled) {
+                    profiler_.recordEnd(entry.handle, ctx.frameIndex, commandBuffer);
+                }
+                
+                VK_SUCCESS_OR_THROW(vkEndCommandBuffer(commandBuffer),
+                                    "Failed to record command buffer");
+                entry.commandBuffer = commandBuffer;
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(recordingMutex_);
+                if (!recordingError_) {
+                    recordingError_ = std::current_exception();
+                }
             }
+            {
+                std::lock_guard<std::mutex> lock(recordingMutex_);
+                --pendingRecordings_;
+            }
+            recordingFinished_.notify_all();
+        });
+    }
+    
+    // Waits for outstanding recordings and submits them in schedule order.
+    // Consecutive nodes on the same queue share a single vkQueueSubmit,
+    // queue submission order keeps the semaphores between them valid.
+    // Nodes that failed to record are submitted without a command buffer, the error is kept for the end of the frame.
+    void submitRecorded(const RenderEvalContext& ctx) {
+        {
+            std::unique_lock<std::mutex> lock(recordingMutex_);
+            recordingFinished_.wait(lock, [this](){ return pendingRecordings_ == 0; });
+            if (recordingError_ && !frameError_) {
+                frameError_ = recordingError_;
+            }
+            recordingError_ = nullptr;
+        }
+        
+        for (size_t idx = 0; idx < recordedNodes_.size(); ++idx) {
+            auto& entry = *recordedNodes_[idx];
+            auto* node = entry.node;
+            if (entry.commandBuffer == VK_NULL_HANDLE && entry.profiled) {
+                // Its queries are never written
+                profiler_.cancelFrameForNode(entry.handle, ctx.frameIndex);
+            }
+            auto waitStage = node->getWaitStage() | transientResources_.getWaitStages(entry.handle);
+            submitBatch_.push_back(node->prepareSubmit(entry.commandBuffer, waitStage, ctx));
             
-            // Make sure we haven't been here already
-            if (visited.find(node) == visited.end()) {
-                visited.emplace(node);
-            } else {
-                continue;
+            // A submit only takes one fence, so a node signalling one closes the batch
+            VkQueue queue = node->getQueue();
+            VkFence fence = **node->signalFences_[ctx.frameIndex];
+            bool lastOnQueue = idx + 1 == recordedNodes_.size() || recordedNodes_[idx + 1]->node->getQueue() != queue;
+            if (lastOnQueue || fence != VK_NULL_HANDLE) {
+                // Reset right before the submit that signals it, so a frame cut short never leaves it unsignaled
+                if (fence != VK_NULL_HANDLE) {
+                    vkResetFences(RenderNode<MAX_FRAMES>::device_, 1, &fence);
+                }
+                VK_SUCCESS_OR_THROW(vkQueueSubmit(queue,
+                                                  static_cast<uint32_t>(submitBatch_.size()),
+                                                  submitBatch_.data(),
+                                                  fence),
+                                    "Failed to submit command buffers.");
+                ++submitCount_;
+                submitBatch_.clear();
             }
-
-            // Kick off the node's work
-            node->submit(ctx);
-
-            // Add the node's children to the queue
-            for (auto& child : node->getChildren()) {
-                if (visited.find(child) == visited.end()) {
-                    nodeQueue.push(child);
+        }
+        recordedNodes_.clear();
+    }
+    
+    // Only ever called from a worker, each worker owns its own pools
+    VkCommandBuffer nextCommandBuffer(uint32_t frameIndex, uint32_t queueFamilyIndex) {
+        auto& pool = recordingPools_[workerPool_->getCurrentWorkerIndex()][frameIndex][queueFamilyIndex];
+        auto device = RenderNode<MAX_FRAMES>::device_;
+        if (!pool.commandPool) {
+            VkCommandPoolCreateInfo poolInfo{};
+            poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+            poolInfo.queueFamilyIndex = queueFamilyIndex;
+            VK_SUCCESS_OR_THROW(VulkanCommandPool::create(pool.commandPool, device, poolInfo),
+                                "Failed to create command pool");
+        }
+        if (pool.used == pool.commandBuffers.size()) {
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = **pool.commandPool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandBufferCount = 1;
+            
+            VkCommandBuffer commandBuffer;
+            VK_SUCCESS_OR_THROW(vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer),
+                                "Failed to allocate command buffers");
+            pool.commandBuffers.push_back(commandBuffer);
+        }
+        return pool.commandBuffers[pool.used++];
+    }
+    
+    void resetRecordingPools(uint32_t frameIndex) {
+        for (auto& workerPools : recordingPools_) {
+            for (auto& [queueFamilyIndex, pool] : workerPools[frameIndex]) {
+                if (pool.used > 0) {
+                    vkResetCommandPool(RenderNode<MAX_FRAMES>::device_, **pool.commandPool, 0);
+                    pool.used = 0;
                 }
             }
         }
     }
     
 private:
+    struct Edge {
+        NodeHandle from;
+        NodeHandle to;
+    };
+    
+    struct ScheduledNode {
+        NodeHandle handle;
+        RenderNode<MAX_FRAMES>* node;
+        // CPU jobs that have to finish before this node submits
+        std::vector<RenderNode<MAX_FRAMES>*> cpuParents;
+        bool flushBefore;
+        // Written by the worker that recorded this frame's commands, left null when recording failed
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        bool profiled = false;
+    };
+    
+    struct RecordingPool {
+        std::unique_ptr<VulkanCommandPool> commandPool;
+        std::vector<VkCommandBuffer> commandBuffers;
+        size_t used = 0;
+    };
+    
     std::vector<std::unique_ptr<RenderNode<MAX_FRAMES>>> nodes_;
-    std::vector<bool> startNodes_;
+    std::vector<Edge> edges_;
+    std::vector<NodeHandle> frameBlockingNodes_;
+    SyncBackend syncBackend_;
+    TransientResources<MAX_FRAMES> transientResources_;
+    GpuProfiler<MAX_FRAMES> profiler_;
+    // Declared after the nodes so workers are joined before the nodes go away
+    std::unique_ptr<ThreadPool> workerPool_;
+    
+    // Timeline state
+    uint64_t timelineValue_ = 0;
+    std::array<uint64_t, MAX_FRAMES> frameTimelineValues_{};
+    std::vector<uint64_t> frameWaitValues_;
+    
+    // Compiled state
+    bool compiled_ = false;
+    std::vector<ScheduledNode> schedule_;
+    
+    // Recording state, command pools are indexed by worker, frame, then queue family
+    std::vector<std::array<std::unordered_map<uint32_t, RecordingPool>, MAX_FRAMES>> recordingPools_;
+    std::vector<ScheduledNode*> recordedNodes_;
+    std::vector<VkSubmitInfo> submitBatch_;
+    uint32_t submitCount_ = 0;
+    std::mutex recordingMutex_;
+    std::condition_variable recordingFinished_;
+    size_t pendingRecordings_ = 0;
+    std::exception_ptr recordingError_;
+    // First recording error of the frame being submitted, only touched by the driving thread
+    std::exception_ptr frameError_;
 };
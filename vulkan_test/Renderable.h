@@ -7,6 +7,8 @@
 
 #include <glm/glm.hpp>
 
+#include <algorithm>
+
 /*
  Overview of Structure:
  
@@ -29,6 +31,16 @@ public:
     
     virtual void update(uint32_t currentImage, VkExtent2D swapChainExtent) = 0;
     
+    // Updates the material and rewrites the frame's descriptor set if a descriptor was rebound.
+    // Called on the thread driving the graph before recording starts, recording only reads the set.
+    void prepareFrame(uint32_t frameIndex, VkExtent2D swapChainExtent) {
+        update(frameIndex, swapChainExtent);
+        // Pick up any descriptor rebound since the set was written
+        if (writtenGenerations_.at(frameIndex) != getDescriptorGeneration()) {
+            populateDescriptorSet(frameIndex);
+        }
+    }
+    
     VkDescriptorSet* getDescriptorSet(uint32_t index) {
         return &descriptorSets_.at(index);
     }
@@ -40,6 +52,11 @@ public:
     VkPipelineLayout getPipelineLayout() {
         return **pipelineLayout_;
     }
+    
+    // One offset per dynamic descriptor in binding order, set by update()
+    const std::vector<uint32_t>& getDynamicOffsets(uint32_t index) {
+        return dynamicOffsets_.at(index);
+    }
 
 protected:
     Material<MAX_FRAMES>(VkDevice device,
@@ -52,6 +69,14 @@ protected:
         for (uint32_t frameIndex = 0; frameIndex < MAX_FRAMES; ++frameIndex) {
             populateDescriptorSet(frameIndex);
         }
+        
+        size_t dynamicCount = std::count_if(descriptors_.begin(), descriptors_.end(), [](auto& descriptor){
+            return descriptor->getType() == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC
+                || descriptor->getType() == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+        });
+        for (auto& offsets : dynamicOffsets_) {
+            offsets.resize(dynamicCount, 0);
+        }
     }
     
     std::unique_ptr<VulkanShaderModule> createShaderModule(const std::vector<char>& code) {
@@ -71,20 +96,35 @@ protected:
     
     void populateDescriptorSet(uint32_t frameIndex) {
         std::vector<VkWriteDescriptorSet> descriptorWrites;
-        descriptorWrites.resize(descriptors_.size());
         
         for (uint idx = 0; idx < descriptors_.size(); ++idx) {
-            descriptorWrites[idx].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            descriptorWrites[idx].dstSet = descriptorSets_.at(frameIndex);
-            descriptorWrites[idx].dstBinding = idx;
-            descriptorWrites[idx].dstArrayElement = 0;
-            descriptorWrites[idx].descriptorType = descriptors_.at(idx)->getType();
-            descriptorWrites[idx].descriptorCount = 1;
-            descriptorWrites[idx].pBufferInfo = descriptors_.at(idx)->getBufferInfo(frameIndex);
-            descriptorWrites[idx].pImageInfo = descriptors_.at(idx)->getImageInfo(frameIndex);
+            // Unbound descriptors get written once their resource exists
+            if (!descriptors_.at(idx)->isBound(frameIndex)) {
+                continue;
+            }
+            VkWriteDescriptorSet descriptorWrite{};
+            descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrite.dstSet = descriptorSets_.at(frameIndex);
+            descriptorWrite.dstBinding = idx;
+            descriptorWrite.dstArrayElement = 0;
+            descriptorWrite.descriptorType = descriptors_.at(idx)->getType();
+            descriptorWrite.descriptorCount = 1;
+            descriptorWrite.pBufferInfo = descriptors_.at(idx)->getBufferInfo(frameIndex);
+            descriptorWrite.pImageInfo = descriptors_.at(idx)->getImageInfo(frameIndex);
+            descriptorWrites.push_back(descriptorWrite);
         }
         
         vkUpdateDescriptorSets(device_, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
+        writtenGenerations_[frameIndex] = getDescriptorGeneration();
+    }
+    
+private:
+    uint32_t getDescriptorGeneration() {
+        uint32_t generation = 0;
+        for (auto& descriptor : descriptors_) {
+            generation += descriptor->getGeneration();
+        }
+        return generation;
     }
     
 private:
@@ -150,6 +190,8 @@ protected:
     std::unique_ptr<VulkanDescriptorSetLayout> descriptorSetLayout_;
     std::unique_ptr<VulkanDescriptorPool> descriptorPool_;
     std::array<VkDescriptorSet, MAX_FRAMES> descriptorSets_;
+    std::array<uint32_t, MAX_FRAMES> writtenGenerations_{};
+    std::array<std::vector<uint32_t>, MAX_FRAMES> dynamicOffsets_;
 };
 
 template<uint MAX_FRAMES>
@@ -209,8 +251,8 @@ public:
         return material_.get();
     }
     
-    void update(uint32_t frameIndex, VkExtent2D swapchainExtent) {
-        material_->update(frameIndex, swapchainExtent);
+    void prepareFrame(uint32_t frameIndex, VkExtent2D swapchainExtent) {
+        material_->prepareFrame(frameIndex, swapchainExtent);
     }
     
     virtual VkBuffer getVertexBuffer() = 0;
@@ -233,24 +275,21 @@ public:
                    const std::vector<uint16_t>& indexData,
                    std::unique_ptr<Material<MAX_FRAMES>>&& material,
                    VkDevice device,
-                   VkPhysicalDevice physicalDevice,
-                   VkQueue graphicsQueue,
-                   VkCommandPool commandPool)
+                   MemoryAllocator& allocator,
+                   UploadEngine& uploadEngine)
     : Renderable<MAX_FRAMES>(std::move(material)), indexCount_(static_cast<uint32_t>(indexData.size())) {
         Buffer<VertexData>::createAndInitialize(vertexBuffer_,
                                                 vertexData,
                                                 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
                                                 device,
-                                                physicalDevice,
-                                                graphicsQueue,
-                                                commandPool);
+                                                allocator,
+                                                uploadEngine);
         Buffer<uint16_t>::createAndInitialize(indexBuffer_,
                                               indexData,
                                               VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
                                               device,
-                                              physicalDevice,
-                                              graphicsQueue,
-                                              commandPool);
+                                              allocator,
+                                              uploadEngine);
     }
 
     VkBuffer getVertexBuffer() {
@@ -1,41 +1,29 @@
 #pragma once
 
-#include "RenderGraph.h"
+#include "RecordedNode.h"
 #include "Renderable.h"
 #include "VkUtil.h"
 
 template<uint MAX_FRAMES>
-class RenderableNode : public RenderNode<MAX_FRAMES> {
+class RenderableNode : public RecordedNode<MAX_FRAMES> {
 public:
+    // Submits to the graphics queue, waiting for the swapchain image to be available before writing out to it
     RenderableNode<MAX_FRAMES>(std::unique_ptr<Renderable<MAX_FRAMES>>&& renderable,
                                VkDevice device,
                                VkQueue graphicsQueue,
-                               VkRenderPass renderPass,
-                               std::array<VkCommandBuffer, MAX_FRAMES> commandBuffers)
-    : RenderNode<MAX_FRAMES>(device),
-    graphicsQueue_(graphicsQueue),
+                               uint32_t graphicsQueueFamily,
+                               VkRenderPass renderPass)
+    : RecordedNode<MAX_FRAMES>(device, graphicsQueue, graphicsQueueFamily, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT),
     renderPass_(renderPass),
-    commandBuffers_(commandBuffers),
     renderable_(std::move(renderable)){}
     
-    NodeDevice getDeviceType() override {
-        return NodeDevice::GPU;
+protected:
+    void prepareFrame(const RenderEvalContext& ctx) override {
+        // Update the renderable (probably a uniform buffer)
+        renderable_->prepareFrame(ctx.frameIndex, ctx.swapchainExtent);
     }
     
-    void submit(RenderEvalContext& ctx) override {
-        // Update the renderable (probably a uniform buffer)
-        renderable_->update(ctx.frameIndex, ctx.swapchainExtent);
-        
-        // Start the command buffer
-        auto& commandBuffer = commandBuffers_[ctx.frameIndex];
-        VkCommandBufferBeginInfo beginInfo{};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = 0; // Optional
-        beginInfo.pInheritanceInfo = nullptr; // Optional
-        
-        VK_SUCCESS_OR_THROW(vkBeginCommandBuffer(commandBuffer, &beginInfo),
-                            "Failed to begin recording command buffer");
-        
+    void record(const RenderEvalContext& ctx, VkCommandBuffer commandBuffer) override {
         // Begin the render pass
         VkRenderPassBeginInfo renderPassInfo{};
         renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
@@ -63,7 +51,8 @@ public:
                                 renderable_->getMaterial()->getPipelineLayout(),
                                 0, 1,
                                 renderable_->getMaterial()->getDescriptorSet(ctx.frameIndex),
-                                0, nullptr);
+                                static_cast<uint32_t>(renderable_->getMaterial()->getDynamicOffsets(ctx.frameIndex).size()),
+                                renderable_->getMaterial()->getDynamicOffsets(ctx.frameIndex).data());
         
         // Set up Viewport & Scissor
         VkViewport viewport{};
@@ -89,35 +78,9 @@ public:
         
         // End render pass
         vkCmdEndRenderPass(commandBuffer);
-        
-        // End command buffer
-        vkEndCommandBuffer(commandBuffer);
-        
-        // Submit to graphics queue
-        VkSubmitInfo submitInfo{};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffer;
-        // (it should wait for the swapchain image to be available before writing out to it)
-        VkPipelineStageFlags waitStages[] {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-        submitInfo.pWaitDstStageMask = waitStages;
-        auto& waitSemaphores = RenderNode<MAX_FRAMES>::waitSemaphores_[ctx.frameIndex];
-        submitInfo.waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size());
-        submitInfo.pWaitSemaphores = waitSemaphores.data();
-        std::array<VkSemaphore,1> signalSemaphores = {**RenderNode<MAX_FRAMES>::signalSemaphores_[ctx.frameIndex]};
-        submitInfo.signalSemaphoreCount = signalSemaphores.size();
-        submitInfo.pSignalSemaphores = signalSemaphores.data();
-
-        VK_SUCCESS_OR_THROW(vkQueueSubmit(graphicsQueue_,
-                                          1,
-                                          &submitInfo,
-                                          **RenderNode<MAX_FRAMES>::signalFences_[ctx.frameIndex]),
-                            "Failed to submit draw command buffer.");
     }
 
 private:
-    VkQueue graphicsQueue_;
     VkRenderPass renderPass_;
-    std::array<VkCommandBuffer, MAX_FRAMES> commandBuffers_;
     std::unique_ptr<Renderable<MAX_FRAMES>> renderable_;
 };
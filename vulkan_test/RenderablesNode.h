@@ -1,38 +1,30 @@
 #pragma once
 
-#include "RenderGraph.h"
+#include "RecordedNode.h"
 #include "Renderable.h"
 #include "VkUtil.h"
 
 template<uint MAX_FRAMES>
-class RenderablesNode : public RenderNode<MAX_FRAMES> {
+class RenderablesNode : public RecordedNode<MAX_FRAMES> {
 public:
     RenderablesNode<MAX_FRAMES>(std::vector<std::shared_ptr<Renderable<MAX_FRAMES>>>&& renderables,
                                VkDevice device,
                                VkQueue graphicsQueue,
-                               VkRenderPass renderPass,
-                               std::array<VkCommandBuffer, MAX_FRAMES> commandBuffers)
-    : RenderNode<MAX_FRAMES>(device),
-    graphicsQueue_(graphicsQueue),
+                               uint32_t graphicsQueueFamily,
+                               VkRenderPass renderPass)
+    : RecordedNode<MAX_FRAMES>(device, graphicsQueue, graphicsQueueFamily, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT),
     renderPass_(renderPass),
-    commandBuffers_(commandBuffers),
     renderables_(std::move(renderables)){}
 
-    NodeDevice getDeviceType() override {
-        return NodeDevice::GPU;
+protected:
+    void prepareFrame(const RenderEvalContext& ctx) override {
+        // Update the renderables (probably a uniform buffer), they may be shared with other nodes
+        for (auto& renderable : renderables_) {
+            renderable->prepareFrame(ctx.frameIndex, ctx.swapchainExtent);
+        }
     }
-
-    void submit(RenderEvalContext& ctx) override {
-        // Start the command buffer
-        auto& commandBuffer = commandBuffers_[ctx.frameIndex];
-        VkCommandBufferBeginInfo beginInfo{};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = 0; // Optional
-        beginInfo.pInheritanceInfo = nullptr; // Optional
-        
-        VK_SUCCESS_OR_THROW(vkBeginCommandBuffer(commandBuffer, &beginInfo),
-                            "Failed to begin recording command buffer");
-        
+    
+    void record(const RenderEvalContext& ctx, VkCommandBuffer commandBuffer) override {
         // Begin the render pass
         VkRenderPassBeginInfo renderPassInfo{};
         renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
@@ -49,9 +41,6 @@ public:
         vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 
         for (auto& renderable : renderables_) {
-            // Update the renderable (probably a uniform buffer)
-            renderable->update(ctx.frameIndex, ctx.swapchainExtent);
-
             // Bind our pipeline, descriptors, and buffers
             vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
                             renderable->getMaterial()->getPipeline());
@@ -64,7 +53,8 @@ public:
                                     renderable->getMaterial()->getPipelineLayout(),
                                     0, 1,
                                     renderable->getMaterial()->getDescriptorSet(ctx.frameIndex),
-                                    0, nullptr);
+                                    static_cast<uint32_t>(renderable->getMaterial()->getDynamicOffsets(ctx.frameIndex).size()),
+                                    renderable->getMaterial()->getDynamicOffsets(ctx.frameIndex).data());
             
             // Set up Viewport & Scissor
             VkViewport viewport{};
@@ -91,35 +81,9 @@ public:
         
         // End render pass
         vkCmdEndRenderPass(commandBuffer);
-        
-        // End command buffer
-        vkEndCommandBuffer(commandBuffer);
-        
-        // Submit to graphics queue
-        VkSubmitInfo submitInfo{};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffer;
-        // (it should wait for the swapchain image to be available before writing out to it)
-        VkPipelineStageFlags waitStages[] {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-        submitInfo.pWaitDstStageMask = waitStages;
-        auto& waitSemaphores = RenderNode<MAX_FRAMES>::waitSemaphores_[ctx.frameIndex];
-        submitInfo.waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size());
-        submitInfo.pWaitSemaphores = waitSemaphores.data();
-        std::array<VkSemaphore,1> signalSemaphores = {**RenderNode<MAX_FRAMES>::signalSemaphores_[ctx.frameIndex]};
-        submitInfo.signalSemaphoreCount = signalSemaphores.size();
-        submitInfo.pSignalSemaphores = signalSemaphores.data();
-
-        VK_SUCCESS_OR_THROW(vkQueueSubmit(graphicsQueue_,
-                                          1,
-                                          &submitInfo,
-                                          **RenderNode<MAX_FRAMES>::signalFences_[ctx.frameIndex]),
-                            "Failed to submit draw command buffer.");
     }
 
 private:
-    VkQueue graphicsQueue_;
     VkRenderPass renderPass_;
-    std::array<VkCommandBuffer, MAX_FRAMES> commandBuffers_;
     std::vector<std::shared_ptr<Renderable<MAX_FRAMES>>> renderables_;
 };
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <stdexcept>
+
+// The ways a node can touch a graph resource
+enum ResourceAccess {
+    SAMPLED_READ,
+    STORAGE_READ,
+    STORAGE_WRITE,
+    COLOR_ATTACHMENT_WRITE,
+    TRANSFER_READ,
+    TRANSFER_WRITE
+};
+
+struct AccessInfo {
+    VkAccessFlags accessMask;
+    // Layout images have to be in for the access
+    VkImageLayout layout;
+    bool writes;
+};
+
+AccessInfo getAccessInfo(ResourceAccess access);
+
+#ifdef VK_WRAP_UTIL_IMPL
+AccessInfo getAccessInfo(ResourceAccess access) {
+    switch (access) {
+        case SAMPLED_READ:
+            return {VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, false};
+        case STORAGE_READ:
+            return {VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_GENERAL, false};
+        case STORAGE_WRITE:
+            return {VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL, true};
+        case COLOR_ATTACHMENT_WRITE:
+            return {VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, true};
+        case TRANSFER_READ:
+            return {VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, false};
+        case TRANSFER_WRITE:
+            return {VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, true};
+    }
+    throw std::invalid_argument("unknown resource access");
+}
+#endif
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+// Allocator for stb_image, so decoded pixels land in memory HostMemoryImporter can import in place.
+// Every allocation is aligned to, and padded to a multiple of, the alignment set at the time.
+// Install it where the stb_image implementation is compiled:
+//     #define STBI_MALLOC(size) StbAllocator::allocate(size)
+//     #define STBI_REALLOC(pointer, size) StbAllocator::reallocate(pointer, size)
+//     #define STBI_FREE(pointer) StbAllocator::release(pointer)
+class StbAllocator {
+public:
+    // Only ever raises the alignment, earlier allocations keep the one they were made with
+    static void raiseAlignment(size_t alignment) {
+        size_t current = alignment_.load();
+        while (current < alignment && !alignment_.compare_exchange_weak(current, alignment)) {}
+    }
+
+    // Whether stb_image allocates through here, only known once it has allocated something
+    static bool isInstalled() {
+        return installed_.load();
+    }
+
+    // Alignment of an allocation, the usable size past it is padded to a multiple of it
+    static size_t getAlignment(const void* pointer) {
+        return getHeader(pointer).alignment;
+    }
+
+    static void* allocate(size_t size) {
+        installed_.store(true);
+        size_t alignment = alignment_.load();
+        size_t paddedSize = std::max<size_t>((size + alignment - 1) / alignment * alignment, alignment);
+        // The header takes up a whole alignment unit in front of the allocation, keeping it aligned
+        auto* base = static_cast<char*>(std::aligned_alloc(alignment, alignment + paddedSize));
+        if (!base) {
+            return nullptr;
+        }
+        void* pointer = base + alignment;
+        getHeader(pointer) = {alignment, size};
+        return pointer;
+    }
+
+    static void* reallocate(void* pointer, size_t size) {
+        if (!pointer) {
+            return allocate(size);
+        }
+        void* reallocated = allocate(size);
+        if (reallocated) {
+            memcpy(reallocated, pointer, std::min(size, getHeader(pointer).size));
+            release(pointer);
+        }
+        return reallocated;
+    }
+
+    static void release(void* pointer) {
+        if (pointer) {
+            std::free(static_cast<char*>(pointer) - getHeader(pointer).alignment);
+        }
+    }
+
+private:
+    struct Header {
+        size_t alignment;
+        size_t size;
+    };
+
+    static Header& getHeader(const void* pointer) {
+        return *reinterpret_cast<Header*>(const_cast<char*>(static_cast<const char*>(pointer)) - sizeof(Header));
+    }
+
+private:
+    // Also leaves room for the header
+    inline static std::atomic<size_t> alignment_{alignof(std::max_align_t)};
+    inline static std::atomic<bool> installed_{false};
+};
@@ -0,0 +1,226 @@
+#pragma once
+
+#include "VkTypes.h"
+#include "VkUtil.h"
+
+#include <cassert>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Handle borrowed from a SyncPool, given back when the lease goes away.
+// Only let go of it once the GPU is done with the handle.
+template<typename Handle>
+class PoolLease {
+public:
+    PoolLease() = default;
+
+    PoolLease(Handle handle, std::function<void(Handle)> release)
+    : handle_(handle), release_(std::move(release)) {}
+
+    ~PoolLease() {
+        reset();
+    }
+
+    PoolLease(PoolLease&& other) noexcept
+    : handle_(other.handle_), release_(std::move(other.release_)) {
+        other.handle_ = VK_NULL_HANDLE;
+        other.release_ = nullptr;
+    }
+
+    PoolLease& operator=(PoolLease&& other) noexcept {
+        if (this != &other) {
+            reset();
+            handle_ = other.handle_;
+            release_ = std::move(other.release_);
+            other.handle_ = VK_NULL_HANDLE;
+            other.release_ = nullptr;
+        }
+        return *this;
+    }
+
+    PoolLease(const PoolLease&) = delete;
+    PoolLease& operator=(const PoolLease&) = delete;
+
+    Handle operator * () const {
+        return handle_;
+    }
+
+    // For the Vulkan calls taking arrays of handles
+    const Handle* get() const {
+        return &handle_;
+    }
+
+    explicit operator bool() const {
+        return handle_ != VK_NULL_HANDLE;
+    }
+
+    void reset() {
+        if (release_) {
+            release_(handle_);
+            release_ = nullptr;
+        }
+        handle_ = VK_NULL_HANDLE;
+    }
+
+private:
+    Handle handle_ = VK_NULL_HANDLE;
+    std::function<void(Handle)> release_;
+};
+
+using FenceLease = PoolLease<VkFence>;
+using SemaphoreLease = PoolLease<VkSemaphore>;
+using CommandBufferLease = PoolLease<VkCommandBuffer>;
+
+struct SyncPoolCounters {
+    // Handed out and not given back yet
+    uint64_t outstanding = 0;
+    // Handed out from the free list
+    uint64_t reused = 0;
+    // Handed out freshly created
+    uint64_t created = 0;
+};
+
+struct SyncPoolStats {
+    SyncPoolCounters fences;
+    SyncPoolCounters semaphores;
+    SyncPoolCounters commandBuffers;
+};
+
+// Device wide free lists of fences, binary semaphores and primary command buffers, so code that
+// submits often (uploads, one-off commands) doesn't create and destroy them on every submit.
+// Fences come back unsignaled. Command buffers come from a pool per thread and queue family and
+// are handed out unbegun, beginning one resets it. Everything is destroyed with the pool, which
+// has to outlive every lease.
+class SyncPool {
+public:
+    SyncPool(VkDevice device) : device_(device) {}
+
+    // Every lease has to be returned by then, getStats() reports the outstanding ones
+    ~SyncPool() {
+        assert(stats_.fences.outstanding == 0
+               && stats_.semaphores.outstanding == 0
+               && stats_.commandBuffers.outstanding == 0
+               && "Destroying sync pool with outstanding leases");
+    }
+
+    SyncPool(const SyncPool&) = delete;
+    SyncPool& operator=(const SyncPool&) = delete;
+
+    FenceLease acquireFence() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        VkFence fence;
+        if (!freeFences_.empty()) {
+            fence = freeFences_.back();
+            freeFences_.pop_back();
+            VK_SUCCESS_OR_THROW(vkResetFences(device_, 1, &fence),
+                                "Failed to reset pooled fence");
+            ++stats_.fences.reused;
+        } else {
+            VkFenceCreateInfo fenceInfo{};
+            fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+            fences_.emplace_back();
+            VK_SUCCESS_OR_THROW(VulkanFence::create(fences_.back(), device_, fenceInfo),
+                                "Failed to create pooled fence");
+            fence = **fences_.back();
+            ++stats_.fences.created;
+        }
+        ++stats_.fences.outstanding;
+        return FenceLease(fence, [this](VkFence released){
+            std::lock_guard<std::mutex> lock(mutex_);
+            freeFences_.push_back(released);
+            --stats_.fences.outstanding;
+        });
+    }
+
+    // Give the lease back only once the semaphore's signal has been waited on
+    SemaphoreLease acquireSemaphore() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        VkSemaphore semaphore;
+        if (!freeSemaphores_.empty()) {
+            semaphore = freeSemaphores_.back();
+            freeSemaphores_.pop_back();
+            ++stats_.semaphores.reused;
+        } else {
+            VkSemaphoreCreateInfo semaphoreInfo{};
+            semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+            semaphores_.emplace_back();
+            VK_SUCCESS_OR_THROW(VulkanSemaphore::create(semaphores_.back(), device_, semaphoreInfo),
+                                "Failed to create pooled semaphore");
+            semaphore = **semaphores_.back();
+            ++stats_.semaphores.created;
+        }
+        ++stats_.semaphores.outstanding;
+        return SemaphoreLease(semaphore, [this](VkSemaphore released){
+            std::lock_guard<std::mutex> lock(mutex_);
+            freeSemaphores_.push_back(released);
+            --stats_.semaphores.outstanding;
+        });
+    }
+
+    // The command buffer must only be recorded on the calling thread,
+    // the lease can be given back from anywhere
+    CommandBufferLease acquireCommandBuffer(uint32_t queueFamilyIndex) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& pool = commandPools_[{std::this_thread::get_id(), queueFamilyIndex}];
+        if (!pool.commandPool) {
+            VkCommandPoolCreateInfo poolInfo{};
+            poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+            poolInfo.queueFamilyIndex = queueFamilyIndex;
+            VK_SUCCESS_OR_THROW(VulkanCommandPool::create(pool.commandPool, device_, poolInfo),
+                                "Failed to create pooled command pool");
+        }
+
+        VkCommandBuffer commandBuffer;
+        if (!pool.freeCommandBuffers.empty()) {
+            commandBuffer = pool.freeCommandBuffers.back();
+            pool.freeCommandBuffers.pop_back();
+            ++stats_.commandBuffers.reused;
+        } else {
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = **pool.commandPool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandBufferCount = 1;
+            VK_SUCCESS_OR_THROW(vkAllocateCommandBuffers(device_, &allocInfo, &commandBuffer),
+                                "Failed to allocate pooled command buffer");
+            ++stats_.commandBuffers.created;
+        }
+        ++stats_.commandBuffers.outstanding;
+        // Map nodes don't move, the free list can be captured directly
+        auto* freeCommandBuffers = &pool.freeCommandBuffers;
+        return CommandBufferLease(commandBuffer, [this, freeCommandBuffers](VkCommandBuffer released){
+            std::lock_guard<std::mutex> lock(mutex_);
+            freeCommandBuffers->push_back(released);
+            --stats_.commandBuffers.outstanding;
+        });
+    }
+
+    SyncPoolStats getStats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    struct CommandPool {
+        // Declared first so it outlives the command buffers allocated from it
+        std::unique_ptr<VulkanCommandPool> commandPool;
+        std::vector<VkCommandBuffer> freeCommandBuffers;
+    };
+
+private:
+    VkDevice device_;
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<VulkanFence>> fences_;
+    std::vector<VkFence> freeFences_;
+    std::vector<std::unique_ptr<VulkanSemaphore>> semaphores_;
+    std::vector<VkSemaphore> freeSemaphores_;
+    // Pools of threads that have exited stay around until the sync pool goes away
+    std::map<std::pair<std::thread::id, uint32_t>, CommandPool> commandPools_;
+    SyncPoolStats stats_;
+};
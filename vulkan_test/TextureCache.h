@@ -0,0 +1,252 @@
+#pragma once
+
+#include "VkTypes.h"
+#include "FileUtil.h"
+#include "Image.h"
+#include "MemoryAllocator.h"
+#include "UploadEngine.h"
+
+#include <stb_image.h>
+
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Shares textures loaded from disk, so every material asking for the same file gets the same image.
+// Textures are keyed by canonical path and load options, and optionally by a hash of the file's bytes to also
+// share byte-identical copies living at different paths.
+// A texture nobody holds a handle to anymore stays cached while the cache fits its memory cap,
+// past that the least recently loaded ones are evicted. Evicted images are destroyed once every
+// frame that might still sample them has completed.
+template<uint MAX_FRAMES>
+class TextureCache {
+public:
+    TextureCache(VkDevice device,
+                 MemoryAllocator& allocator,
+                 UploadEngine& uploadEngine,
+                 VkDeviceSize memoryCap = 256 * 1024 * 1024,
+                 bool hashContents = false)
+    : device_(device),
+    allocator_(allocator),
+    uploadEngine_(uploadEngine),
+    memoryCap_(memoryCap),
+    hashContents_(hashContents) {}
+
+    TextureCache(const TextureCache&) = delete;
+    TextureCache& operator=(const TextureCache&) = delete;
+
+    // Loads the texture unless it is cached already. KTX2 files keep the mips they ship, other files
+    // get a generated chain when generateMipmaps is set.
+    // Loads of the same file with different options get separate images.
+    // A freshly loaded image can't be used until the upload engine's next flush has completed.
+    std::shared_ptr<Image> load(const std::string& filePath,
+                                const std::vector<uint32_t>& queueFamilies = {},
+                                bool generateMipmaps = false) {
+        std::string path = std::filesystem::weakly_canonical(filePath).string();
+        bool ktx2 = std::filesystem::path(path).extension() == ".ktx2";
+        Options options{queueFamilies, generateMipmaps && !ktx2};
+        std::sort(options.queueFamilies.begin(), options.queueFamilies.end());
+        options.queueFamilies.erase(std::unique(options.queueFamilies.begin(), options.queueFamilies.end()),
+                                    options.queueFamilies.end());
+
+        std::string key = getKey(path, options);
+        auto cached = entriesByKey_.find(key);
+        if (cached != entriesByKey_.end()) {
+            return touch(*cached->second);
+        }
+
+        std::vector<char> contents;
+        uint64_t contentHash = 0;
+        if (hashContents_) {
+            contents = readFile(path);
+            contentHash = hash(contents);
+            // The hash only narrows the search, the cached file is read back to compare the bytes in full
+            auto [first, last] = entriesByHash_.equal_range(contentHash);
+            for (auto identical = first; identical != last; ++identical) {
+                auto& entry = identical->second;
+                if (entry->options == options
+                    && entry->contentSize == contents.size()
+                    && std::filesystem::exists(entry->path)
+                    && readFile(entry->path) == contents) {
+                    entry->keys.push_back(key);
+                    entriesByKey_[key] = entry;
+                    return touch(*entry);
+                }
+            }
+        }
+
+        std::unique_ptr<Image> loaded;
+        if (ktx2) {
+            Image::createFromKtx2File(loaded, path, uploadEngine_, device_, allocator_, options.queueFamilies);
+        } else if (hashContents_) {
+            // The bytes were read for the hash already
+            int width, height, channels;
+            stbi_uc* pixels = stbi_load_from_memory(reinterpret_cast<const stbi_uc*>(contents.data()),
+                                                    static_cast<int>(contents.size()),
+                                                    &width, &height, &channels, STBI_rgb_alpha);
+            if (!pixels) {
+                throw std::runtime_error("Failed to load texture image.");
+            }
+            Image::createFromUcharBuffer(loaded,
+                                         pixels,
+                                         width,
+                                         height,
+                                         static_cast<VkDeviceSize>(width) * height * 4,
+                                         uploadEngine_,
+                                         device_,
+                                         allocator_,
+                                         options.queueFamilies,
+                                         false,
+                                         options.generateMipmaps);
+            stbi_image_free(pixels);
+        } else {
+            Image::createFromFile(loaded,
+                                  path,
+                                  uploadEngine_,
+                                  device_,
+                                  allocator_,
+                                  options.queueFamilies,
+                                  options.generateMipmaps);
+        }
+
+        auto entry = std::make_shared<Entry>();
+        entry->image = std::move(loaded);
+        entry->keys.push_back(key);
+        entry->path = path;
+        entry->options = std::move(options);
+        entry->contentHash = contentHash;
+        entry->contentSize = contents.size();
+        entry->size = entry->image->getMemorySize();
+        cachedSize_ += entry->size;
+        entriesByKey_[key] = entry;
+        if (hashContents_) {
+            entriesByHash_.emplace(contentHash, entry);
+        }
+
+        auto image = touch(*entry);
+        trim();
+        return image;
+    }
+
+    // Call once per frame, after the frame slot's previous submission has completed
+    void beginFrame(uint32_t frameIndex) {
+        frameIndex_ = frameIndex;
+        // Retired the last time this frame index came around, every frame since started without them
+        retiredImages_.at(frameIndex).clear();
+        trim();
+    }
+
+    // Drops every texture nobody holds a handle to, regardless of the cap
+    void evictUnused() {
+        trim(0);
+    }
+
+    void setMemoryCap(VkDeviceSize memoryCap) {
+        memoryCap_ = memoryCap;
+        trim();
+    }
+
+    // Device memory taken by cached textures, in use or not
+    VkDeviceSize getCachedSize() {
+        return cachedSize_;
+    }
+
+private:
+    struct Options {
+        // Sorted and without duplicates
+        std::vector<uint32_t> queueFamilies;
+        bool generateMipmaps = false;
+
+        bool operator==(const Options& other) const {
+            return queueFamilies == other.queueFamilies && generateMipmaps == other.generateMipmaps;
+        }
+    };
+
+    struct Entry {
+        // The cache's own reference, the entry is unused when it is the only one left
+        std::shared_ptr<Image> image;
+        // Every canonical path and options key resolving to this entry
+        std::vector<std::string> keys;
+        // Canonical path of the file the image was loaded from
+        std::string path;
+        Options options;
+        uint64_t contentHash = 0;
+        size_t contentSize = 0;
+        VkDeviceSize size = 0;
+        uint64_t lastUse = 0;
+    };
+
+    std::shared_ptr<Image> touch(Entry& entry) {
+        entry.lastUse = ++useCounter_;
+        return entry.image;
+    }
+
+    void trim() {
+        trim(memoryCap_);
+    }
+
+    // Evicts unused entries, least recently loaded first, until the cache fits the cap
+    void trim(VkDeviceSize memoryCap) {
+        while (cachedSize_ > memoryCap) {
+            std::shared_ptr<Entry> oldest;
+            for (auto& [key, entry] : entriesByKey_) {
+                if (entry->image.use_count() == 1 && (!oldest || entry->lastUse < oldest->lastUse)) {
+                    oldest = entry;
+                }
+            }
+            if (!oldest) {
+                return;
+            }
+
+            for (auto& key : oldest->keys) {
+                entriesByKey_.erase(key);
+            }
+            auto [first, last] = entriesByHash_.equal_range(oldest->contentHash);
+            for (auto hashed = first; hashed != last; ++hashed) {
+                if (hashed->second == oldest) {
+                    entriesByHash_.erase(hashed);
+                    break;
+                }
+            }
+            cachedSize_ -= oldest->size;
+            retiredImages_.at(frameIndex_).push_back(std::move(oldest->image));
+        }
+    }
+
+    static std::string getKey(const std::string& path, const Options& options) {
+        std::string key = path + (options.generateMipmaps ? "|mips|" : "||");
+        for (uint32_t queueFamily : options.queueFamilies) {
+            key += std::to_string(queueFamily) + ",";
+        }
+        return key;
+    }
+
+    // FNV-1a, only used to find candidates for byte-identical files
+    static uint64_t hash(const std::vector<char>& contents) {
+        uint64_t hash = 14695981039346656037ull;
+        for (char byte : contents) {
+            hash ^= static_cast<uint8_t>(byte);
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+private:
+    VkDevice device_;
+    MemoryAllocator& allocator_;
+    UploadEngine& uploadEngine_;
+    VkDeviceSize memoryCap_;
+    bool hashContents_;
+
+    std::unordered_map<std::string, std::shared_ptr<Entry>> entriesByKey_;
+    std::unordered_multimap<uint64_t, std::shared_ptr<Entry>> entriesByHash_;
+    VkDeviceSize cachedSize_ = 0;
+    uint64_t useCounter_ = 0;
+
+    uint32_t frameIndex_ = 0;
+    std::array<std::vector<std::shared_ptr<Image>>, MAX_FRAMES> retiredImages_;
+};
@@ -0,0 +1,268 @@
+#pragma once
+
+#include "VkTypes.h"
+#include "Descriptor.h"
+#include "HostMemoryImporter.h"
+#include "Image.h"
+#include "MemoryAllocator.h"
+#include "StbAllocator.h"
+#include "ThreadPool.h"
+#include "UploadEngine.h"
+
+#include <stb_image.h>
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Texture requested from a TextureStreamer, only usable once resident
+class StreamedTexture {
+public:
+    const std::string& getFilePath() {
+        return filePath_;
+    }
+
+    bool isResident() {
+        return resident_;
+    }
+
+    // Failed textures keep showing the placeholder
+    bool hasFailed() {
+        return failed_;
+    }
+
+    // Why the texture failed, empty otherwise
+    const std::string& getError() {
+        return error_;
+    }
+
+    // Null until the texture is resident
+    Image* getImage() {
+        return resident_ ? image_.get() : nullptr;
+    }
+
+private:
+    template<uint MAX_FRAMES>
+    friend class TextureStreamer;
+
+    std::string filePath_;
+    std::unique_ptr<Image> image_;
+    bool resident_ = false;
+    bool failed_ = false;
+    std::string error_;
+};
+
+// Loads textures in the background. Files are decoded in parallel on a thread pool, decoded pixels
+// are recorded on the upload engine by update() and the descriptors they were requested for point at
+// a placeholder until the copy has landed, so the render loop never waits on disk or decode.
+// Everything but the decode runs on the thread calling request() and update(), which must be the
+// one recording on the upload engine.
+// With a host memory importer and StbAllocator installed, stb decodes straight into importable allocations,
+// so the copies read the pixels in place and they are neither copied nor staged on the CPU.
+template<uint MAX_FRAMES>
+class TextureStreamer {
+public:
+    // uploadBudget caps the bytes recorded per update(), at least one texture always goes out.
+    // The placeholder is recorded on the upload engine, it is usable after the engine's next flush completes.
+    TextureStreamer(VkDevice device,
+                    MemoryAllocator& allocator,
+                    UploadEngine& uploadEngine,
+                    HostMemoryImporter* hostMemoryImporter = nullptr,
+                    const std::vector<uint32_t>& queueFamilies = {},
+                    VkDeviceSize uploadBudget = 16 * 1024 * 1024)
+    : device_(device),
+    allocator_(allocator),
+    uploadEngine_(uploadEngine),
+    importAlignment_(hostMemoryImporter && hostMemoryImporter->isEnabled() ? hostMemoryImporter->getAlignment() : 0),
+    queueFamilies_(queueFamilies),
+    uploadBudget_(uploadBudget) {
+        if (importAlignment_ != 0) {
+            StbAllocator::raiseAlignment(static_cast<size_t>(importAlignment_));
+        }
+        
+        // Mid grey stands out the least while textures pop in
+        unsigned char placeholderPixels[] = {128, 128, 128, 255};
+        Image::createFromUcharBuffer(placeholder_,
+                                     placeholderPixels,
+                                     1, 1,
+                                     sizeof(placeholderPixels),
+                                     uploadEngine_,
+                                     device_,
+                                     allocator_,
+                                     queueFamilies_);
+    }
+
+    // Uploads still in flight have to be complete on the device by then, they may read the decoded pixels in place
+    ~TextureStreamer() {
+        stopping_ = true;
+    }
+
+    TextureStreamer(const TextureStreamer&) = delete;
+    TextureStreamer& operator=(const TextureStreamer&) = delete;
+
+    VkImageView getPlaceholderImageView() {
+        return placeholder_->getImageView();
+    }
+
+    // Queues the file for decoding and binds the descriptors to the placeholder until the texture is resident
+    std::shared_ptr<StreamedTexture> request(const std::string& filePath,
+                                             std::vector<std::shared_ptr<ImageDescriptor<MAX_FRAMES>>> descriptors = {},
+                                             bool generateMipmaps = true) {
+        auto request = std::make_shared<Request>();
+        request->texture = std::make_shared<StreamedTexture>();
+        request->texture->filePath_ = filePath;
+        request->descriptors = std::move(descriptors);
+        request->generateMipmaps = generateMipmaps;
+        bindImageView(request->descriptors, placeholder_->getImageView());
+        ++pendingCount_;
+
+        // Nothing to decode on most frames, so the workers only exist once something is streamed
+        if (!decodePool_) {
+            decodePool_ = std::make_unique<ThreadPool>();
+        }
+        decodePool_->submit([this, request](){
+            if (stopping_) {
+                return;
+            }
+            // Failures are reported by update(), on the thread that owns the texture
+            try {
+                int width = 0, height = 0, channels = 0;
+                request->pixels.reset(stbi_load(request->texture->filePath_.c_str(), &width, &height, &channels, STBI_rgb_alpha));
+                if (request->pixels) {
+                    request->width = static_cast<uint32_t>(width);
+                    request->height = static_cast<uint32_t>(height);
+                    // stb decoded straight into importable memory when StbAllocator is installed
+                    request->importable = importAlignment_ != 0
+                        && StbAllocator::isInstalled()
+                        && StbAllocator::getAlignment(request->pixels.get()) % importAlignment_ == 0;
+                } else {
+                    const char* reason = stbi_failure_reason();
+                    request->error = reason ? reason : "unknown error";
+                }
+            } catch (const std::exception& e) {
+                request->pixels.reset();
+                request->error = e.what();
+            }
+
+            std::lock_guard<std::mutex> lock(decodedMutex_);
+            decoded_.push_back(request);
+        });
+        return request->texture;
+    }
+
+    // Call once per frame before recording it: swaps in textures whose upload completed
+    // and records uploads for what has been decoded since, then flushes the upload engine.
+    void update() {
+        while (!uploading_.empty() && uploadEngine_.isComplete(uploading_.front()->upload)) {
+            auto& request = uploading_.front();
+            request->pixels.reset();
+            request->texture->resident_ = true;
+            bindImageView(request->descriptors, request->texture->image_->getImageView());
+            uploading_.pop_front();
+            --pendingCount_;
+        }
+
+        std::vector<std::shared_ptr<Request>> recorded;
+        VkDeviceSize recordedSize = 0;
+        while (recordedSize < uploadBudget_) {
+            std::shared_ptr<Request> request;
+            {
+                std::lock_guard<std::mutex> lock(decodedMutex_);
+                if (decoded_.empty()) {
+                    break;
+                }
+                request = std::move(decoded_.front());
+                decoded_.pop_front();
+            }
+
+            if (!request->pixels) {
+                request->texture->error_ = "Failed to load texture " + request->texture->filePath_ + ": " + request->error;
+                request->texture->failed_ = true;
+                --pendingCount_;
+                continue;
+            }
+
+            VkDeviceSize imageSize = static_cast<VkDeviceSize>(request->width) * request->height * 4;
+            Image::createFromUcharBuffer(request->texture->image_,
+                                         request->pixels.get(),
+                                         request->width,
+                                         request->height,
+                                         imageSize,
+                                         uploadEngine_,
+                                         device_,
+                                         allocator_,
+                                         queueFamilies_,
+                                         request->importable,
+                                         request->generateMipmaps);
+            // Staged by now, unless the copy reads the pixels in place
+            if (!request->importable) {
+                request->pixels.reset();
+            }
+            recordedSize += imageSize;
+            recorded.push_back(std::move(request));
+        }
+
+        if (recorded.empty()) {
+            return;
+        }
+        UploadEngine::Handle upload = uploadEngine_.flush();
+        for (auto& request : recorded) {
+            request->upload = upload;
+            uploading_.push_back(std::move(request));
+        }
+    }
+
+    // Requests that aren't resident and haven't failed yet
+    size_t getPendingCount() {
+        return pendingCount_;
+    }
+
+private:
+    struct Request {
+        std::shared_ptr<StreamedTexture> texture;
+        std::vector<std::shared_ptr<ImageDescriptor<MAX_FRAMES>>> descriptors;
+        bool generateMipmaps = true;
+        // Filled in by the decode job
+        std::unique_ptr<stbi_uc, void(*)(void*)> pixels{nullptr, stbi_image_free};
+        // The pixels sit in an allocation the upload engine can import
+        bool importable = false;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        std::string error;
+        UploadEngine::Handle upload = 0;
+    };
+
+    void bindImageView(const std::vector<std::shared_ptr<ImageDescriptor<MAX_FRAMES>>>& descriptors, VkImageView imageView) {
+        // Materials rewrite each frame's set before that frame is recorded again
+        for (auto& descriptor : descriptors) {
+            for (uint32_t frameIndex = 0; frameIndex < MAX_FRAMES; ++frameIndex) {
+                descriptor->bindImageView(frameIndex, imageView);
+            }
+        }
+    }
+
+private:
+    VkDevice device_;
+    MemoryAllocator& allocator_;
+    UploadEngine& uploadEngine_;
+    // Zero when host memory can't be imported
+    VkDeviceSize importAlignment_;
+    std::vector<uint32_t> queueFamilies_;
+    VkDeviceSize uploadBudget_;
+
+    std::unique_ptr<Image> placeholder_;
+
+    std::mutex decodedMutex_;
+    std::deque<std::shared_ptr<Request>> decoded_;
+    // Recorded on the upload engine, in flush order
+    std::deque<std::shared_ptr<Request>> uploading_;
+    size_t pendingCount_ = 0;
+
+    std::atomic<bool> stopping_ = false;
+    // Declared last so the workers are joined before anything they touch goes away
+    std::unique_ptr<ThreadPool> decodePool_;
+};
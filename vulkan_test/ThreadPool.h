@@ -0,0 +1,165 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool. Each worker owns a deque, pops its own jobs LIFO
+// and steals from the front of the other workers' deques when it runs dry.
+// Jobs are expected to report their own errors, one that throws anyway doesn't take its
+// worker down: the exception is kept and rethrown by rethrowJobError().
+class ThreadPool {
+public:
+    using Job = std::function<void()>;
+    
+    explicit ThreadPool(uint32_t threadCount = defaultThreadCount()) {
+        for (uint32_t idx = 0; idx < threadCount; ++idx) {
+            queues_.push_back(std::make_unique<WorkQueue>());
+        }
+        for (uint32_t idx = 0; idx < threadCount; ++idx) {
+            threads_.emplace_back([this, idx](){ workerLoop(idx); });
+        }
+    }
+    
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+    
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    
+    void submit(Job job) {
+        // Jobs spawned from a worker stay local, everything else is spread round robin
+        uint32_t queueIndex = currentPool_ == this
+            ? currentWorker_
+            : nextQueue_.fetch_add(1, std::memory_order_relaxed) % static_cast<uint32_t>(queues_.size());
+        // Counted before it is visible, a worker popping it right away must not take the count below zero
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex_);
+            ++pendingJobs_;
+        }
+        {
+            std::lock_guard<std::mutex> lock(queues_[queueIndex]->mutex);
+            queues_[queueIndex]->jobs.push_back(std::move(job));
+        }
+        wake_.notify_one();
+    }
+    
+    uint32_t getThreadCount() {
+        return static_cast<uint32_t>(threads_.size());
+    }
+    
+    // Index of the worker running the calling thread, or getThreadCount() off the pool
+    uint32_t getCurrentWorkerIndex() {
+        return currentPool_ == this ? currentWorker_ : getThreadCount();
+    }
+    
+    // Rethrows the first exception a job let escape since the last call
+    void rethrowJobError() {
+        std::exception_ptr error;
+        {
+            std::lock_guard<std::mutex> lock(errorMutex_);
+            std::swap(error, jobError_);
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    
+    static uint32_t defaultThreadCount() {
+        // Leave a core for the thread driving the frame
+        return std::max(2u, std::thread::hardware_concurrency()) - 1;
+    }
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+    
+    bool tryPop(uint32_t workerIndex, Job& outJob) {
+        // Newest local job first, it is most likely to be cache warm
+        {
+            auto& own = *queues_[workerIndex];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.jobs.empty()) {
+                outJob = std::move(own.jobs.back());
+                own.jobs.pop_back();
+                return true;
+            }
+        }
+        // Otherwise steal the oldest job from someone else
+        for (size_t offset = 1; offset < queues_.size(); ++offset) {
+            auto& victim = *queues_[(workerIndex + offset) % queues_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.jobs.empty()) {
+                outJob = std::move(victim.jobs.front());
+                victim.jobs.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    void workerLoop(uint32_t workerIndex) {
+        currentPool_ = this;
+        currentWorker_ = workerIndex;
+        
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(sleepMutex_);
+                wake_.wait(lock, [this](){ return pendingJobs_ > 0 || stopping_; });
+                // Drain everything before shutting down
+                if (pendingJobs_ == 0 && stopping_) {
+                    return;
+                }
+            }
+            
+            Job job;
+            if (tryPop(workerIndex, job)) {
+                {
+                    std::lock_guard<std::mutex> lock(sleepMutex_);
+                    --pendingJobs_;
+                }
+                try {
+                    job();
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(errorMutex_);
+                    if (!jobError_) {
+                        jobError_ = std::current_exception();
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<WorkQueue>> queues_;
+    std::vector<std::thread> threads_;
+    std::atomic<uint32_t> nextQueue_ = 0;
+    
+    std::mutex sleepMutex_;
+    std::condition_variable wake_;
+    uint32_t pendingJobs_ = 0;
+    bool stopping_ = false;
+    
+    std::mutex errorMutex_;
+    std::exception_ptr jobError_;
+    
+    inline static thread_local ThreadPool* currentPool_ = nullptr;
+    inline static thread_local uint32_t currentWorker_ = 0;
+};
@@ -0,0 +1,551 @@
+#pragma once
+
+#include "VkTypes.h"
+#include "VkUtil.h"
+#include "Descriptor.h"
+#include "ResourceAccess.h"
+#include "MemoryBudget.h"
+
+#include <sstream>
+
+struct TransientImageInfo {
+    uint32_t width;
+    uint32_t height;
+    VkFormat format;
+    VkImageUsageFlags usage;
+};
+
+struct TransientBufferInfo {
+    VkDeviceSize size;
+    VkBufferUsageFlags usage;
+};
+
+// Images and buffers that only live within a frame of the render graph.
+// One copy exists per frame in flight, and resources whose users are all
+// ordered after every user of another resource get placed on its memory.
+// Contents never survive between frames, layouts follow the declared accesses.
+template<uint MAX_FRAMES>
+class TransientResources {
+public:
+    using ResourceHandle = uint32_t;
+    using NodeHandle = uint32_t;
+
+    // The budget is optional, when given the slots' memory is reported to it
+    TransientResources<MAX_FRAMES>(VkDevice device, VkPhysicalDevice physicalDevice, MemoryBudget* budget = nullptr)
+    : device_(device), physicalDevice_(physicalDevice), budget_(budget) {}
+
+    ~TransientResources<MAX_FRAMES>() {
+        if (!memory_[0].empty()) {
+            reportSlotMemory(false);
+        }
+    }
+
+    ResourceHandle addImage(const TransientImageInfo& info) {
+        Resource resource{};
+        resource.isImage = true;
+        resource.imageInfo = info;
+        return addResource(std::move(resource));
+    }
+
+    ResourceHandle addBuffer(const TransientBufferInfo& info) {
+        Resource resource{};
+        resource.isImage = false;
+        resource.bufferInfo = info;
+        return addResource(std::move(resource));
+    }
+
+    int addUse(ResourceHandle handle,
+               NodeHandle node,
+               uint32_t queueFamily,
+               ResourceAccess access,
+               VkPipelineStageFlags stages) {
+        if (handle >= resources_.size() || stages == 0) {
+            return EXIT_FAILURE;
+        }
+        resources_[handle].uses.push_back({node, queueFamily, access, stages});
+        allocated_ = false;
+        return 0;
+    }
+
+    // Rewrites the descriptor with the resource's image view once it has been allocated
+    int bindImageDescriptor(ResourceHandle handle, std::shared_ptr<ImageDescriptor<MAX_FRAMES>> descriptor) {
+        if (handle >= resources_.size() || !resources_[handle].isImage) {
+            return EXIT_FAILURE;
+        }
+        resources_[handle].descriptorBinders.push_back([this, handle, descriptor](){
+            for (uint frameIdx = 0; frameIdx < MAX_FRAMES; ++frameIdx) {
+                descriptor->bindImageView(frameIdx, getImageView(handle, frameIdx));
+            }
+        });
+        return 0;
+    }
+
+    template<typename Data>
+    int bindBufferDescriptor(ResourceHandle handle, std::shared_ptr<BufferDescriptor<Data, MAX_FRAMES>> descriptor) {
+        if (handle >= resources_.size() || resources_[handle].isImage) {
+            return EXIT_FAILURE;
+        }
+        resources_[handle].descriptorBinders.push_back([this, handle, descriptor](){
+            auto elementCount = static_cast<int>(resources_[handle].bufferInfo.size / sizeof(Data));
+            for (uint frameIdx = 0; frameIdx < MAX_FRAMES; ++frameIdx) {
+                descriptor->bindBuffer(getBuffer(handle, frameIdx), elementCount, frameIdx);
+            }
+        });
+        return 0;
+    }
+
+    bool isAllocated() {
+        return allocated_;
+    }
+
+    // Creates every resource and places them in memory.
+    // reachable[a][b] is true if node b always executes after node a within a frame.
+    void allocate(const std::vector<std::vector<bool>>& reachable) {
+        for (ResourceHandle handle = 0; handle < resources_.size(); ++handle) {
+            // Without uses its lifetime is empty, so it would alias with everything
+            if (resources_[handle].uses.empty()) {
+                std::stringstream err;
+                err << "Transient resource " << handle << " has no declared uses";
+                throw std::runtime_error(err.str());
+            }
+        }
+
+        // Resources may still be in use by a frame in flight
+        if (!memory_[0].empty()) {
+            vkDeviceWaitIdle(device_);
+            reportSlotMemory(false);
+        }
+
+        for (ResourceHandle handle = 0; handle < resources_.size(); ++handle) {
+            createObjects(handle);
+        }
+        for (uint frameIdx = 0; frameIdx < MAX_FRAMES; ++frameIdx) {
+            memory_[frameIdx].clear();
+        }
+
+        // Greedily place each resource on the first slot it doesn't overlap with
+        slots_.clear();
+        for (ResourceHandle handle = 0; handle < resources_.size(); ++handle) {
+            auto& requirements = resources_[handle].requirements;
+            bool placed = false;
+            for (auto& slot : slots_) {
+                if ((slot.memoryTypeBits & requirements.memoryTypeBits) == 0) {
+                    continue;
+                }
+                bool disjoint = std::all_of(slot.residents.begin(), slot.residents.end(), [&](ResourceHandle resident){
+                    return happensBefore(resident, handle, reachable) || happensBefore(handle, resident, reachable);
+                });
+                if (disjoint) {
+                    slot.size = std::max(slot.size, requirements.size);
+                    slot.alignment = std::max(slot.alignment, requirements.alignment);
+                    slot.memoryTypeBits &= requirements.memoryTypeBits;
+                    slot.residents.push_back(handle);
+                    resources_[handle].slot = &slot - slots_.data();
+                    placed = true;
+                    break;
+                }
+            }
+            if (!placed) {
+                resources_[handle].slot = slots_.size();
+                slots_.push_back({requirements.size, requirements.alignment, requirements.memoryTypeBits, {handle}});
+            }
+        }
+
+        for (uint frameIdx = 0; frameIdx < MAX_FRAMES; ++frameIdx) {
+            for (auto& slot : slots_) {
+                VkMemoryRequirements slotRequirements{slot.size, slot.alignment, slot.memoryTypeBits};
+                if (budget_) {
+                    budget_->reserve(getSlotMemoryType(slot), slot.size);
+                }
+                memory_[frameIdx].emplace_back();
+                VK_SUCCESS_OR_THROW(VulkanMemory::createFromRequirements(memory_[frameIdx].back(),
+                                                                         device_,
+                                                                         physicalDevice_,
+                                                                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                                                         slotRequirements),
+                                    "Failed to allocate transient resource memory");
+            }
+            for (auto& resource : resources_) {
+                bindObjects(resource, frameIdx);
+            }
+        }
+        reportSlotMemory(true);
+
+        for (auto& resource : resources_) {
+            for (auto& binder : resource.descriptorBinders) {
+                binder();
+            }
+        }
+        allocated_ = true;
+    }
+
+    // Works out the layout transitions and queue family ownership transfers each
+    // node needs from the declared accesses.
+    // Called on every compile, order is the submission order of the nodes.
+    void planBarriers(const std::vector<NodeHandle>& order, const std::vector<std::vector<bool>>& reachable) {
+        std::vector<size_t> position(reachable.size());
+        for (size_t idx = 0; idx < order.size(); ++idx) {
+            position[order[idx]] = idx;
+        }
+        nodeBarriers_.assign(reachable.size(), NodeBarriers{});
+        
+        for (ResourceHandle handle = 0; handle < resources_.size(); ++handle) {
+            auto& resource = resources_[handle];
+            auto uses = mergeUses(handle);
+            std::sort(uses.begin(), uses.end(), [&](const PlannedUse& a, const PlannedUse& b){
+                return position[a.node] < position[b.node];
+            });
+            
+            for (size_t idx = 0; idx < uses.size(); ++idx) {
+                auto& use = uses[idx];
+                for (size_t prev = 0; prev < idx; ++prev) {
+                    // The first use discards the contents, so everyone else has to come after it.
+                    // Past that only reads of the same layout on the same queue family may overlap.
+                    bool conflicting = prev == 0 || uses[prev].writes || use.writes
+                        || uses[prev].queueFamily != use.queueFamily
+                        || (resource.isImage && uses[prev].layout != use.layout);
+                    if (conflicting && !reachable[uses[prev].node][use.node]) {
+                        std::stringstream err;
+                        err << "Transient resource " << handle << " is accessed by unordered nodes "
+                            << uses[prev].node << " and " << use.node;
+                        throw std::runtime_error(err.str());
+                    }
+                }
+                
+                // The semaphores from the node's parents already carry the memory
+                // dependency, they only have to be waited on before the stages touching it
+                auto& barriers = nodeBarriers_[use.node];
+                barriers.waitStages |= use.stages;
+                
+                VkImageLayout oldLayout = idx == 0 ? VK_IMAGE_LAYOUT_UNDEFINED : uses[idx - 1].layout;
+                // Exclusive resources keep their contents across queue families only through
+                // a release on the previous family followed by an acquire on the new one
+                bool transfersOwnership = idx > 0 && uses[idx - 1].queueFamily != use.queueFamily;
+                if (!transfersOwnership && (!resource.isImage || oldLayout == use.layout)) {
+                    continue;
+                }
+                uint32_t srcQueueFamily = transfersOwnership ? uses[idx - 1].queueFamily : VK_QUEUE_FAMILY_IGNORED;
+                uint32_t dstQueueFamily = transfersOwnership ? use.queueFamily : VK_QUEUE_FAMILY_IGNORED;
+                
+                // Chained to the semaphore wait on the same stages
+                auto& acquire = barriers.before;
+                acquire.srcStages |= use.stages;
+                acquire.dstStages |= use.stages;
+                for (uint frameIdx = 0; frameIdx < MAX_FRAMES; ++frameIdx) {
+                    if (resource.isImage) {
+                        auto barrier = makeImageBarrier(resource, frameIdx, oldLayout, use.layout, srcQueueFamily, dstQueueFamily);
+                        barrier.dstAccessMask = use.accessMask;
+                        acquire.imageBarriers[frameIdx].push_back(barrier);
+                    } else {
+                        auto barrier = makeBufferBarrier(resource, frameIdx, srcQueueFamily, dstQueueFamily);
+                        barrier.dstAccessMask = use.accessMask;
+                        acquire.bufferBarriers[frameIdx].push_back(barrier);
+                    }
+                }
+                if (!transfersOwnership) {
+                    continue;
+                }
+                
+                auto& previous = uses[idx - 1];
+                auto& release = nodeBarriers_[previous.node].after;
+                release.srcStages |= previous.stages;
+                release.dstStages |= VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+                VkAccessFlags releaseAccess = previous.writes ? previous.accessMask : 0;
+                for (uint frameIdx = 0; frameIdx < MAX_FRAMES; ++frameIdx) {
+                    if (resource.isImage) {
+                        auto barrier = makeImageBarrier(resource, frameIdx, oldLayout, use.layout, srcQueueFamily, dstQueueFamily);
+                        barrier.srcAccessMask = releaseAccess;
+                        release.imageBarriers[frameIdx].push_back(barrier);
+                    } else {
+                        auto barrier = makeBufferBarrier(resource, frameIdx, srcQueueFamily, dstQueueFamily);
+                        barrier.srcAccessMask = releaseAccess;
+                        release.bufferBarriers[frameIdx].push_back(barrier);
+                    }
+                }
+            }
+        }
+    }
+    
+    // All of the node's acquires and transitions go out in a single barrier at the start of its commands
+    void recordBarriersBefore(NodeHandle node, uint32_t frameIndex, VkCommandBuffer commandBuffer) {
+        if (node < nodeBarriers_.size()) {
+            recordBatch(nodeBarriers_[node].before, frameIndex, commandBuffer);
+        }
+    }
+    
+    // Releases to other queue families go out at the end of the node's commands
+    void recordBarriersAfter(NodeHandle node, uint32_t frameIndex, VkCommandBuffer commandBuffer) {
+        if (node < nodeBarriers_.size()) {
+            recordBatch(nodeBarriers_[node].after, frameIndex, commandBuffer);
+        }
+    }
+    
+    // Stages of the node that have to wait on its parents before touching a resource
+    VkPipelineStageFlags getWaitStages(NodeHandle node) {
+        return node < nodeBarriers_.size() ? nodeBarriers_[node].waitStages : 0;
+    }
+
+    VkImage getImage(ResourceHandle handle, uint32_t frameIndex) {
+        return **resources_.at(handle).images[frameIndex];
+    }
+
+    VkImageView getImageView(ResourceHandle handle, uint32_t frameIndex) {
+        return **resources_.at(handle).imageViews[frameIndex];
+    }
+
+    VkBuffer getBuffer(ResourceHandle handle, uint32_t frameIndex) {
+        return **resources_.at(handle).buffers[frameIndex];
+    }
+
+    // Device memory backing a single frame's resources
+    VkDeviceSize getAllocatedSize() {
+        VkDeviceSize size = 0;
+        for (auto& slot : slots_) {
+            size += slot.size;
+        }
+        return size;
+    }
+
+    // What a single frame's resources would take up without aliasing
+    VkDeviceSize getRequestedSize() {
+        VkDeviceSize size = 0;
+        for (auto& resource : resources_) {
+            size += resource.requirements.size;
+        }
+        return size;
+    }
+
+private:
+    struct Use {
+        NodeHandle node;
+        uint32_t queueFamily;
+        ResourceAccess access;
+        VkPipelineStageFlags stages;
+    };
+
+    // Every access a node declared on a resource, folded together
+    struct PlannedUse {
+        NodeHandle node;
+        uint32_t queueFamily;
+        VkPipelineStageFlags stages;
+        VkAccessFlags accessMask;
+        VkImageLayout layout;
+        bool writes;
+    };
+
+    struct BarrierBatch {
+        VkPipelineStageFlags srcStages = 0;
+        VkPipelineStageFlags dstStages = 0;
+        std::array<std::vector<VkImageMemoryBarrier>, MAX_FRAMES> imageBarriers;
+        std::array<std::vector<VkBufferMemoryBarrier>, MAX_FRAMES> bufferBarriers;
+    };
+
+    struct NodeBarriers {
+        VkPipelineStageFlags waitStages = 0;
+        BarrierBatch before;
+        BarrierBatch after;
+    };
+
+    struct Resource {
+        bool isImage;
+        TransientImageInfo imageInfo;
+        TransientBufferInfo bufferInfo;
+        std::vector<Use> uses;
+        std::vector<std::function<void()>> descriptorBinders;
+
+        // Allocation state
+        VkMemoryRequirements requirements;
+        size_t slot;
+        std::array<std::unique_ptr<VulkanImage>, MAX_FRAMES> images;
+        std::array<std::unique_ptr<VulkanImageView>, MAX_FRAMES> imageViews;
+        std::array<std::unique_ptr<VulkanBuffer>, MAX_FRAMES> buffers;
+    };
+
+    struct MemorySlot {
+        VkDeviceSize size;
+        VkDeviceSize alignment;
+        uint32_t memoryTypeBits;
+        std::vector<ResourceHandle> residents;
+    };
+
+    uint32_t getSlotMemoryType(const MemorySlot& slot) {
+        auto memoryTypeIndex = VulkanMemory::findMemoryType(physicalDevice_, slot.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        if (!memoryTypeIndex.has_value()) {
+            throw std::runtime_error("No memory type fits the transient resource slot");
+        }
+        return memoryTypeIndex.value();
+    }
+
+    // Every slot is backed once per frame in flight
+    void reportSlotMemory(bool allocated) {
+        if (!budget_) {
+            return;
+        }
+        for (auto& slot : slots_) {
+            uint32_t memoryTypeIndex = getSlotMemoryType(slot);
+            for (uint frameIdx = 0; frameIdx < MAX_FRAMES; ++frameIdx) {
+                if (allocated) {
+                    budget_->recordDeviceAllocation(memoryTypeIndex, slot.size);
+                    budget_->recordResourceAllocation(memoryTypeIndex, TRANSIENT_MEMORY, slot.size);
+                } else {
+                    budget_->recordDeviceFree(memoryTypeIndex, slot.size);
+                    budget_->recordResourceFree(memoryTypeIndex, TRANSIENT_MEMORY, slot.size);
+                }
+            }
+        }
+    }
+
+    ResourceHandle addResource(Resource&& resource) {
+        resources_.emplace_back(std::move(resource));
+        allocated_ = false;
+        return static_cast<ResourceHandle>(resources_.size() - 1);
+    }
+
+    // Every use of a has to finish before any use of b starts
+    bool happensBefore(ResourceHandle a, ResourceHandle b, const std::vector<std::vector<bool>>& reachable) {
+        for (auto& useA : resources_[a].uses) {
+            for (auto& useB : resources_[b].uses) {
+                if (!reachable[useA.node][useB.node]) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    std::vector<PlannedUse> mergeUses(ResourceHandle handle) {
+        std::vector<PlannedUse> planned;
+        for (auto& use : resources_[handle].uses) {
+            auto info = getAccessInfo(use.access);
+            auto existing = std::find_if(planned.begin(), planned.end(), [&](const PlannedUse& other){
+                return other.node == use.node;
+            });
+            if (existing == planned.end()) {
+                planned.push_back({use.node, use.queueFamily, use.stages, info.accessMask, info.layout, info.writes});
+                continue;
+            }
+            // A node sees the resource in a single layout
+            if (resources_[handle].isImage && existing->layout != info.layout) {
+                std::stringstream err;
+                err << "Node " << use.node << " needs transient image " << handle << " in two different layouts";
+                throw std::runtime_error(err.str());
+            }
+            existing->stages |= use.stages;
+            existing->accessMask |= info.accessMask;
+            existing->writes = existing->writes || info.writes;
+        }
+        return planned;
+    }
+
+    VkImageMemoryBarrier makeImageBarrier(Resource& resource,
+                                          uint32_t frameIndex,
+                                          VkImageLayout oldLayout,
+                                          VkImageLayout newLayout,
+                                          uint32_t srcQueueFamily,
+                                          uint32_t dstQueueFamily) {
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.oldLayout = oldLayout;
+        barrier.newLayout = newLayout;
+        barrier.srcQueueFamilyIndex = srcQueueFamily;
+        barrier.dstQueueFamilyIndex = dstQueueFamily;
+        barrier.image = **resource.images[frameIndex];
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.levelCount = 1;
+        barrier.subresourceRange.layerCount = 1;
+        return barrier;
+    }
+
+    VkBufferMemoryBarrier makeBufferBarrier(Resource& resource,
+                                            uint32_t frameIndex,
+                                            uint32_t srcQueueFamily,
+                                            uint32_t dstQueueFamily) {
+        VkBufferMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.srcQueueFamilyIndex = srcQueueFamily;
+        barrier.dstQueueFamilyIndex = dstQueueFamily;
+        barrier.buffer = **resource.buffers[frameIndex];
+        barrier.size = VK_WHOLE_SIZE;
+        return barrier;
+    }
+
+    void recordBatch(BarrierBatch& batch, uint32_t frameIndex, VkCommandBuffer commandBuffer) {
+        auto& imageBarriers = batch.imageBarriers[frameIndex];
+        auto& bufferBarriers = batch.bufferBarriers[frameIndex];
+        if (imageBarriers.empty() && bufferBarriers.empty()) {
+            return;
+        }
+        vkCmdPipelineBarrier(commandBuffer,
+                             batch.srcStages,
+                             batch.dstStages,
+                             0,
+                             0, nullptr,
+                             static_cast<uint32_t>(bufferBarriers.size()), bufferBarriers.data(),
+                             static_cast<uint32_t>(imageBarriers.size()), imageBarriers.data());
+    }
+
+    void createObjects(ResourceHandle handle) {
+        auto& resource = resources_[handle];
+        for (uint frameIdx = 0; frameIdx < MAX_FRAMES; ++frameIdx) {
+            resource.imageViews[frameIdx].reset();
+            if (resource.isImage) {
+                VkImageCreateInfo imageInfo{};
+                imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+                imageInfo.imageType = VK_IMAGE_TYPE_2D;
+                imageInfo.extent = VkExtent3D{resource.imageInfo.width, resource.imageInfo.height, 1};
+                imageInfo.mipLevels = 1;
+                imageInfo.arrayLayers = 1;
+                imageInfo.format = resource.imageInfo.format;
+                imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+                imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+                imageInfo.usage = resource.imageInfo.usage;
+                imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+                imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+                VK_SUCCESS_OR_THROW(VulkanImage::create(resource.images[frameIdx], device_, imageInfo),
+                                    "Failed to create transient image");
+            } else {
+                VkBufferCreateInfo bufferInfo{};
+                bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+                bufferInfo.size = resource.bufferInfo.size;
+                bufferInfo.usage = resource.bufferInfo.usage;
+                bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+                VK_SUCCESS_OR_THROW(VulkanBuffer::create(resource.buffers[frameIdx], device_, bufferInfo),
+                                    "Failed to create transient buffer");
+            }
+        }
+
+        // Every frame's copy is created identically
+        if (resource.isImage) {
+            vkGetImageMemoryRequirements(device_, **resource.images[0], &resource.requirements);
+        } else {
+            vkGetBufferMemoryRequirements(device_, **resource.buffers[0], &resource.requirements);
+        }
+    }
+
+    void bindObjects(Resource& resource, uint32_t frameIndex) {
+        VkDeviceMemory memory = **memory_[frameIndex][resource.slot];
+        if (resource.isImage) {
+            VK_SUCCESS_OR_THROW(vkBindImageMemory(device_, **resource.images[frameIndex], memory, 0),
+                                "Failed to bind transient image memory");
+            VK_SUCCESS_OR_THROW(VulkanImageView::createForImageWithFormat(resource.imageViews[frameIndex],
+                                                                          device_,
+                                                                          **resource.images[frameIndex],
+                                                                          resource.imageInfo.format),
+                                "Failed to create transient image view");
+        } else {
+            VK_SUCCESS_OR_THROW(vkBindBufferMemory(device_, **resource.buffers[frameIndex], memory, 0),
+                                "Failed to bind transient buffer memory");
+        }
+    }
+
+private:
+    VkDevice device_;
+    VkPhysicalDevice physicalDevice_;
+    MemoryBudget* budget_;
+    // Declared first so it outlives the resources bound to it
+    std::array<std::vector<std::unique_ptr<VulkanMemory>>, MAX_FRAMES> memory_;
+    std::vector<Resource> resources_;
+    std::vector<MemorySlot> slots_;
+    std::vector<NodeBarriers> nodeBarriers_;
+    bool allocated_ = true;
+};
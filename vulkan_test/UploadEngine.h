@@ -0,0 +1,634 @@
+#pragma once
+
+#include "VkTypes.h"
+#include "VkUtil.h"
+#include "HostMemoryImporter.h"
+#include "MemoryAllocator.h"
+#include "SyncPool.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <numeric>
+#include <vector>
+
+// Where one mip level sits in the data handed to UploadEngine::uploadToImageLevels
+struct ImageLevel {
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+};
+
+// Records buffer and image uploads into a single command buffer on the transfer queue.
+// Nothing is submitted until flush(), which hands back a handle the caller can poll or
+// wait on, so loading many resources costs one submit instead of a queue stall each.
+// Exclusive resources are handed over to the owner queue family once their copy lands.
+// Data is staged in a persistently mapped ring that batches give back once their fence signals,
+// large uploads are split into chunks so they stream through it instead of growing it.
+// Image data the caller keeps alive until the upload completes is imported instead of staged when the device allows it.
+// Work that needs the owner queue, like generating mipmaps, goes out with the batch after the acquires.
+// Not thread safe, uploads are expected to come from a single loading thread.
+class UploadEngine {
+public:
+    using Handle = uint64_t;
+
+    // Minimum alignment of staged ranges, image copies also align to the texel or block size of their format
+    static constexpr VkDeviceSize STAGING_ALIGNMENT = 16;
+
+    UploadEngine(VkDevice device,
+                 VkPhysicalDevice physicalDevice,
+                 MemoryAllocator& allocator,
+                 SyncPool& syncPool,
+                 VkQueue transferQueue,
+                 uint32_t transferFamily,
+                 VkQueue ownerQueue,
+                 uint32_t ownerFamily,
+                 HostMemoryImporter* hostMemoryImporter = nullptr,
+                 VkDeviceSize stagingCapacity = 32 * 1024 * 1024)
+    : device_(device),
+    physicalDevice_(physicalDevice),
+    allocator_(allocator),
+    syncPool_(syncPool),
+    transferQueue_(transferQueue),
+    transferFamily_(transferFamily),
+    ownerQueue_(ownerQueue),
+    ownerFamily_(ownerFamily),
+    hostMemoryImporter_(hostMemoryImporter),
+    stagingCapacity_(stagingCapacity) {
+        createStagingBuffer();
+    }
+
+    ~UploadEngine() {
+        // Staging memory can't go away, nor pooled objects be handed out again, while a copy still runs
+        for (auto& batch : inFlight_) {
+            vkWaitForFences(device_, 1, batch.fence.get(), VK_TRUE, UINT64_MAX);
+        }
+    }
+
+    UploadEngine(const UploadEngine&) = delete;
+    UploadEngine& operator=(const UploadEngine&) = delete;
+
+    // Family of the queue doing the copies, concurrent resources have to include it
+    uint32_t getQueueFamily() {
+        return transferFamily_;
+    }
+
+    void uploadToBuffer(const void* data, VkDeviceSize size, VkBuffer buffer, VkDeviceSize offset = 0) {
+        for (VkDeviceSize chunkStart = 0; chunkStart < size; chunkStart += getMaxChunkSize()) {
+            VkDeviceSize chunkSize = std::min(getMaxChunkSize(), size - chunkStart);
+
+            VkBufferCopy region{};
+            region.srcOffset = stage(static_cast<const char*>(data) + chunkStart, chunkSize);
+            region.dstOffset = offset + chunkStart;
+            region.size = chunkSize;
+            // Staging can flush the pending batch, so the command buffer is fetched after it
+            vkCmdCopyBuffer(getCommandBuffer(), **stagingBuffer_, buffer, 1, &region);
+        }
+
+        VkBufferMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        setQueueFamilies(barrier, false);
+        barrier.buffer = buffer;
+        barrier.offset = offset;
+        barrier.size = size;
+        pending_.bufferBarriers.push_back(barrier);
+    }
+
+    // Fills the first mip of a 2D color image and leaves it in finalLayout.
+    // Set dataOutlivesUpload if data stays valid until the batch completes. When it was allocated for import,
+    // aligned to the importer's alignment and padded to a multiple of it, the copy then reads it in place.
+    void uploadToImage(const void* data,
+                       VkDeviceSize size,
+                       VkImage image,
+                       uint32_t width,
+                       uint32_t height,
+                       VkImageLayout finalLayout,
+                       bool concurrent = false,
+                       bool dataOutlivesUpload = false) {
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = image;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.levelCount = 1;
+        barrier.subresourceRange.layerCount = 1;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        vkCmdPipelineBarrier(getCommandBuffer(),
+                             VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0,
+                             0, nullptr,
+                             0, nullptr,
+                             1, &barrier);
+
+        std::unique_ptr<ImportedHostBuffer> imported;
+        VkDeviceSize importSize = 0;
+        if (hostMemoryImporter_ != nullptr) {
+            VkDeviceSize alignment = hostMemoryImporter_->getAlignment();
+            importSize = (size + alignment - 1) / alignment * alignment;
+        }
+        if (dataOutlivesUpload
+            && hostMemoryImporter_ != nullptr
+            && hostMemoryImporter_->canImport(data, importSize)
+            && hostMemoryImporter_->import(imported, data, importSize) == VK_SUCCESS) {
+            VkBufferImageCopy region{};
+            region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            region.imageSubresource.layerCount = 1;
+            region.imageExtent = {width, height, 1};
+            vkCmdCopyBufferToImage(getCommandBuffer(),
+                                   imported->getBuffer(),
+                                   image,
+                                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                   1, &region);
+            pending_.importedBuffers.push_back(std::move(imported));
+            recordImageRelease(barrier, finalLayout, concurrent);
+            return;
+        }
+
+        recordLevelCopy(data, {0, size, width, height}, image, 0, {1, 1});
+        recordImageRelease(barrier, finalLayout, concurrent);
+    }
+
+    // Fills every mip level of a 2D color image from one blob and leaves them all in finalLayout.
+    // blockExtent is the texel block size of compressed formats, {1, 1} otherwise.
+    void uploadToImageLevels(const void* data,
+                             const std::vector<ImageLevel>& levels,
+                             VkImage image,
+                             VkExtent2D blockExtent,
+                             VkImageLayout finalLayout,
+                             bool concurrent = false) {
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = image;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.levelCount = static_cast<uint32_t>(levels.size());
+        barrier.subresourceRange.layerCount = 1;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        vkCmdPipelineBarrier(getCommandBuffer(),
+                             VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0,
+                             0, nullptr,
+                             0, nullptr,
+                             1, &barrier);
+
+        for (uint32_t level = 0; level < levels.size(); ++level) {
+            recordLevelCopy(data, levels[level], image, level, blockExtent);
+        }
+
+        recordImageRelease(barrier, finalLayout, concurrent);
+    }
+
+    VkFormatFeatureFlags getFormatFeatures(VkFormat format) {
+        VkFormatProperties formatProperties;
+        vkGetPhysicalDeviceFormatProperties(physicalDevice_, format, &formatProperties);
+        return formatProperties.optimalTilingFeatures;
+    }
+
+    // Whether images of the format can be uploaded to and sampled
+    bool canSampleFormat(VkFormat format) {
+        VkFormatFeatureFlags sampledFeatures = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+        return (getFormatFeatures(format) & sampledFeatures) == sampledFeatures;
+    }
+
+    // Whether generateMipmaps works for images of the format, they should get a single level otherwise
+    bool canGenerateMipmaps(VkFormat format) {
+        VkFormatFeatureFlags blitFeatures = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+        return (getFormatFeatures(format) & blitFeatures) == blitFeatures;
+    }
+
+    // Fills mip levels 1 and up by blitting each level from the one above, then moves every level to finalLayout.
+    // Upload the first level with a TRANSFER_SRC_OPTIMAL final layout beforehand.
+    // The blits run on the owner queue, which has to support graphics.
+    void generateMipmaps(VkImage image,
+                         VkFormat format,
+                         uint32_t width,
+                         uint32_t height,
+                         uint32_t mipLevels,
+                         VkImageLayout finalLayout) {
+        // Formats that can't be filtered linearly still get mips, just blockier ones
+        VkFilter filter = (getFormatFeatures(format) & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT)
+            ? VK_FILTER_LINEAR
+            : VK_FILTER_NEAREST;
+        // Make sure there is a batch to go out with
+        getCommandBuffer();
+        pending_.ownerOps.push_back([=](VkCommandBuffer commandBuffer){
+            recordMipmapBlits(commandBuffer, image, width, height, mipLevels, finalLayout, filter);
+        });
+    }
+
+    // Submits everything recorded since the last flush.
+    // Returns the handle of the last batch if nothing was recorded.
+    Handle flush() {
+        if (!pending_.transferCommands) {
+            return nextHandle_ - 1;
+        }
+        Batch batch = std::move(pending_);
+        pending_ = Batch{};
+        batch.handle = nextHandle_++;
+        batch.stagingEnd = stagingHead_;
+
+        // Exclusive resources still belong to the transfer family, the owner has to acquire them
+        std::vector<VkBufferMemoryBarrier> bufferAcquires;
+        std::vector<VkImageMemoryBarrier> imageAcquires;
+        for (auto& barrier : batch.bufferBarriers) {
+            if (barrier.srcQueueFamilyIndex != barrier.dstQueueFamilyIndex) {
+                bufferAcquires.push_back(barrier);
+            } else {
+                barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+            }
+        }
+        for (auto& barrier : batch.imageBarriers) {
+            if (barrier.srcQueueFamilyIndex != barrier.dstQueueFamilyIndex) {
+                imageAcquires.push_back(barrier);
+            } else {
+                barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+            }
+        }
+        recordBarriers(*batch.transferCommands, VK_PIPELINE_STAGE_TRANSFER_BIT, batch.bufferBarriers, batch.imageBarriers);
+        bool separateOwner = transferFamily_ != ownerFamily_;
+        if (!separateOwner) {
+            // The transfer queue is the owner queue, so owner work follows the copies directly
+            for (auto& op : batch.ownerOps) {
+                op(*batch.transferCommands);
+            }
+        }
+        VK_SUCCESS_OR_THROW(vkEndCommandBuffer(*batch.transferCommands),
+                            "Failed to record upload commands");
+
+        batch.fence = syncPool_.acquireFence();
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = batch.transferCommands.get();
+
+        bool needsOwnerSubmit = !bufferAcquires.empty() || !imageAcquires.empty() || (separateOwner && !batch.ownerOps.empty());
+        if (!needsOwnerSubmit) {
+            VK_SUCCESS_OR_THROW(vkQueueSubmit(transferQueue_, 1, &submitInfo, *batch.fence),
+                                "Failed to submit uploads");
+            inFlight_.push_back(std::move(batch));
+            return inFlight_.back().handle;
+        }
+
+        batch.ownershipSemaphore = syncPool_.acquireSemaphore();
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = batch.ownershipSemaphore.get();
+        VK_SUCCESS_OR_THROW(vkQueueSubmit(transferQueue_, 1, &submitInfo, VK_NULL_HANDLE),
+                            "Failed to submit uploads");
+
+        batch.ownerCommands = acquireCommandBuffer(ownerFamily_);
+        for (auto& barrier : bufferAcquires) {
+            barrier.srcAccessMask = 0;
+            barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+        }
+        for (auto& barrier : imageAcquires) {
+            barrier.srcAccessMask = 0;
+            barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+        }
+        // Chained to the semaphore wait below
+        recordBarriers(*batch.ownerCommands, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, bufferAcquires, imageAcquires);
+        for (auto& op : batch.ownerOps) {
+            op(*batch.ownerCommands);
+        }
+        VK_SUCCESS_OR_THROW(vkEndCommandBuffer(*batch.ownerCommands),
+                            "Failed to record upload acquire commands");
+
+        VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+        VkSubmitInfo acquireInfo{};
+        acquireInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        acquireInfo.waitSemaphoreCount = 1;
+        acquireInfo.pWaitSemaphores = batch.ownershipSemaphore.get();
+        acquireInfo.pWaitDstStageMask = &waitStage;
+        acquireInfo.commandBufferCount = 1;
+        acquireInfo.pCommandBuffers = batch.ownerCommands.get();
+        VK_SUCCESS_OR_THROW(vkQueueSubmit(ownerQueue_, 1, &acquireInfo, *batch.fence),
+                            "Failed to submit upload acquires");
+
+        inFlight_.push_back(std::move(batch));
+        return inFlight_.back().handle;
+    }
+
+    bool isComplete(Handle handle) {
+        retire();
+        return handle <= completed_;
+    }
+
+    void wait(Handle handle) {
+        for (auto& batch : inFlight_) {
+            if (batch.handle > handle) {
+                break;
+            }
+            vkWaitForFences(device_, 1, batch.fence.get(), VK_TRUE, UINT64_MAX);
+        }
+        retire();
+    }
+
+private:
+    struct Batch {
+        Handle handle = 0;
+        // Pooled, they go back to the sync pool once the batch is retired
+        CommandBufferLease transferCommands;
+        CommandBufferLease ownerCommands;
+        SemaphoreLease ownershipSemaphore;
+        FenceLease fence;
+        // Staging ring position once the batch was flushed, everything before it is free once the fence signals
+        VkDeviceSize stagingEnd = 0;
+        // Make the copies visible, or release them to the owner family
+        std::vector<VkBufferMemoryBarrier> bufferBarriers;
+        std::vector<VkImageMemoryBarrier> imageBarriers;
+        // Host memory the copies read in place, released with the batch
+        std::vector<std::unique_ptr<ImportedHostBuffer>> importedBuffers;
+        // Recorded on the owner queue once the copies are visible there
+        std::vector<std::function<void(VkCommandBuffer)>> ownerOps;
+    };
+
+    CommandBufferLease acquireCommandBuffer(uint32_t queueFamilyIndex) {
+        CommandBufferLease commandBuffer = syncPool_.acquireCommandBuffer(queueFamilyIndex);
+
+        // Beginning implicitly resets a recycled command buffer
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        VK_SUCCESS_OR_THROW(vkBeginCommandBuffer(*commandBuffer, &beginInfo),
+                            "Failed to begin upload command buffer");
+        return commandBuffer;
+    }
+
+    VkCommandBuffer getCommandBuffer() {
+        if (!pending_.transferCommands) {
+            pending_.transferCommands = acquireCommandBuffer(transferFamily_);
+        }
+        return *pending_.transferCommands;
+    }
+
+    void createStagingBuffer() {
+        VkBufferCreateInfo bufferInfo{};
+        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferInfo.size = stagingCapacity_;
+        bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        VK_SUCCESS_OR_THROW(VulkanBuffer::create(stagingBuffer_, device_, bufferInfo),
+                            "Failed to create staging buffer");
+
+        VkMemoryRequirements memoryRequirements;
+        vkGetBufferMemoryRequirements(device_, **stagingBuffer_, &memoryRequirements);
+        VK_SUCCESS_OR_THROW(allocator_.allocate(stagingMemory_,
+                                                memoryRequirements,
+                                                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                                STAGING_MEMORY),
+                            "Failed to allocate staging memory");
+        VK_SUCCESS_OR_THROW(vkBindBufferMemory(device_, **stagingBuffer_, stagingMemory_->getMemory(), stagingMemory_->getOffset()),
+                            "Failed to bind staging memory");
+    }
+
+    // Leaves room for other batches to stay in flight while a large upload streams through
+    VkDeviceSize getMaxChunkSize() {
+        return stagingCapacity_ / 4;
+    }
+
+    // Copies the data into the staging ring and returns its offset in the staging buffer, a multiple of alignment.
+    // Blocks on older batches while the ring is full.
+    VkDeviceSize stage(const void* data, VkDeviceSize size, VkDeviceSize alignment = STAGING_ALIGNMENT) {
+        if (size > stagingCapacity_) {
+            throw std::runtime_error("Upload chunk does not fit in the staging buffer.");
+        }
+
+        // Head and tail only ever grow, their position in the ring is modulo the capacity
+        VkDeviceSize start;
+        while (true) {
+            if (stagingTail_ == stagingHead_) {
+                // Nothing in flight, start over at the beginning of the ring
+                stagingHead_ = stagingTail_ = (stagingHead_ + stagingCapacity_ - 1) / stagingCapacity_ * stagingCapacity_;
+            }
+            // The offset within the ring is what gets aligned, the capacity needn't be a multiple of the alignment
+            VkDeviceSize ringOffset = stagingHead_ % stagingCapacity_;
+            start = stagingHead_ - ringOffset + (ringOffset + alignment - 1) / alignment * alignment;
+            // Ranges never wrap around the end of the buffer
+            if (start - (stagingHead_ - ringOffset) + size > stagingCapacity_) {
+                start = stagingHead_ - ringOffset + stagingCapacity_;
+            }
+            if (start + size - stagingTail_ <= stagingCapacity_) {
+                break;
+            }
+            reclaimStaging();
+        }
+        stagingHead_ = start + size;
+
+        VkDeviceSize offset = start % stagingCapacity_;
+        memcpy(static_cast<char*>(stagingMemory_->getMappedData()) + offset, data, static_cast<size_t>(size));
+        return offset;
+    }
+
+    // Large levels are copied a band of block rows at a time
+    void recordLevelCopy(const void* data, const ImageLevel& level, VkImage image, uint32_t mipLevel, VkExtent2D blockExtent) {
+        uint32_t blockRows = (level.height + blockExtent.height - 1) / blockExtent.height;
+        VkDeviceSize rowPitch = level.size / blockRows;
+        // Copies into images need buffer offsets aligned to the texel or block size of the format
+        VkDeviceSize blockSize = rowPitch / ((level.width + blockExtent.width - 1) / blockExtent.width);
+        VkDeviceSize alignment = std::lcm(STAGING_ALIGNMENT, blockSize);
+        uint32_t rowsPerChunk = static_cast<uint32_t>(std::max<VkDeviceSize>(1, getMaxChunkSize() / rowPitch));
+        for (uint32_t blockRow = 0; blockRow < blockRows; blockRow += rowsPerChunk) {
+            uint32_t rowCount = std::min(rowsPerChunk, blockRows - blockRow);
+            uint32_t row = blockRow * blockExtent.height;
+
+            VkBufferImageCopy region{};
+            region.bufferOffset = stage(static_cast<const char*>(data) + level.offset + blockRow * rowPitch,
+                                        rowCount * rowPitch,
+                                        alignment);
+            region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            region.imageSubresource.mipLevel = mipLevel;
+            region.imageSubresource.layerCount = 1;
+            region.imageOffset = {0, static_cast<int32_t>(row), 0};
+            // Partial blocks at the edge are copied with the level's real extent
+            region.imageExtent = {level.width, std::min(rowCount * blockExtent.height, level.height - row), 1};
+            vkCmdCopyBufferToImage(getCommandBuffer(),
+                                   **stagingBuffer_,
+                                   image,
+                                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                   1, &region);
+        }
+    }
+
+    void recordMipmapBlits(VkCommandBuffer commandBuffer,
+                           VkImage image,
+                           uint32_t width,
+                           uint32_t height,
+                           uint32_t mipLevels,
+                           VkImageLayout finalLayout,
+                           VkFilter filter) {
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = image;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.layerCount = 1;
+
+        // The copy into the first level has to be visible to the blits reading it,
+        // every level below it is written from scratch
+        std::array<VkImageMemoryBarrier, 2> setupBarriers{barrier, barrier};
+        setupBarriers[0].subresourceRange.baseMipLevel = 0;
+        setupBarriers[0].subresourceRange.levelCount = 1;
+        setupBarriers[0].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        setupBarriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        setupBarriers[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        setupBarriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        setupBarriers[1].subresourceRange.baseMipLevel = 1;
+        setupBarriers[1].subresourceRange.levelCount = mipLevels - 1;
+        setupBarriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        setupBarriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        setupBarriers[1].srcAccessMask = 0;
+        setupBarriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0,
+                             0, nullptr,
+                             0, nullptr,
+                             static_cast<uint32_t>(setupBarriers.size()), setupBarriers.data());
+
+        int32_t mipWidth = static_cast<int32_t>(width);
+        int32_t mipHeight = static_cast<int32_t>(height);
+        barrier.subresourceRange.levelCount = 1;
+        for (uint32_t level = 1; level < mipLevels; ++level) {
+            int32_t nextWidth = std::max(mipWidth / 2, 1);
+            int32_t nextHeight = std::max(mipHeight / 2, 1);
+
+            VkImageBlit blit{};
+            blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            blit.srcSubresource.mipLevel = level - 1;
+            blit.srcSubresource.layerCount = 1;
+            blit.srcOffsets[1] = {mipWidth, mipHeight, 1};
+            blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            blit.dstSubresource.mipLevel = level;
+            blit.dstSubresource.layerCount = 1;
+            blit.dstOffsets[1] = {nextWidth, nextHeight, 1};
+            vkCmdBlitImage(commandBuffer,
+                           image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           1, &blit,
+                           filter);
+
+            // The level just written is the source of the next one
+            barrier.subresourceRange.baseMipLevel = level;
+            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            vkCmdPipelineBarrier(commandBuffer,
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 0,
+                                 0, nullptr,
+                                 0, nullptr,
+                                 1, &barrier);
+
+            mipWidth = nextWidth;
+            mipHeight = nextHeight;
+        }
+
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = mipLevels;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.newLayout = finalLayout;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                             0,
+                             0, nullptr,
+                             0, nullptr,
+                             1, &barrier);
+    }
+
+    // The transition to the final layout goes out with the rest of the batch
+    void recordImageRelease(VkImageMemoryBarrier barrier, VkImageLayout finalLayout, bool concurrent) {
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = finalLayout;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+        setQueueFamilies(barrier, concurrent);
+        pending_.imageBarriers.push_back(barrier);
+    }
+
+    // Waits for the oldest batch so its staging range can be reused
+    void reclaimStaging() {
+        if (inFlight_.empty()) {
+            flush();
+        }
+        vkWaitForFences(device_, 1, inFlight_.front().fence.get(), VK_TRUE, UINT64_MAX);
+        retire();
+    }
+
+    template<typename Barrier>
+    void setQueueFamilies(Barrier& barrier, bool concurrent) {
+        bool transfersOwnership = !concurrent && transferFamily_ != ownerFamily_;
+        barrier.srcQueueFamilyIndex = transfersOwnership ? transferFamily_ : VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = transfersOwnership ? ownerFamily_ : VK_QUEUE_FAMILY_IGNORED;
+    }
+
+    void recordBarriers(VkCommandBuffer commandBuffer,
+                        VkPipelineStageFlags srcStage,
+                        const std::vector<VkBufferMemoryBarrier>& bufferBarriers,
+                        const std::vector<VkImageMemoryBarrier>& imageBarriers) {
+        if (bufferBarriers.empty() && imageBarriers.empty()) {
+            return;
+        }
+        vkCmdPipelineBarrier(commandBuffer,
+                             srcStage,
+                             VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                             0,
+                             0, nullptr,
+                             static_cast<uint32_t>(bufferBarriers.size()), bufferBarriers.data(),
+                             static_cast<uint32_t>(imageBarriers.size()), imageBarriers.data());
+    }
+
+    // Frees every batch at the front of the queue whose fence has signaled
+    void retire() {
+        while (!inFlight_.empty() && vkGetFenceStatus(device_, *inFlight_.front().fence) == VK_SUCCESS) {
+            auto& batch = inFlight_.front();
+            completed_ = batch.handle;
+            stagingTail_ = batch.stagingEnd;
+            inFlight_.pop_front();
+        }
+    }
+
+private:
+    VkDevice device_;
+    VkPhysicalDevice physicalDevice_;
+    MemoryAllocator& allocator_;
+    SyncPool& syncPool_;
+    VkQueue transferQueue_;
+    uint32_t transferFamily_;
+    VkQueue ownerQueue_;
+    uint32_t ownerFamily_;
+    HostMemoryImporter* hostMemoryImporter_;
+
+    // Declared first so it outlives the buffer bound to it
+    std::unique_ptr<MemoryAllocation> stagingMemory_;
+    std::unique_ptr<VulkanBuffer> stagingBuffer_;
+    VkDeviceSize stagingCapacity_;
+    VkDeviceSize stagingHead_ = 0;
+    VkDeviceSize stagingTail_ = 0;
+
+    Batch pending_;
+    std::deque<Batch> inFlight_;
+    Handle nextHandle_ = 1;
+    // Every batch up to this handle has finished
+    Handle completed_ = 0;
+};
@@ -3,6 +3,7 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
+#include <bitset>
 #include <memory>
 #include <optional>
 #include <iostream>
@@ -93,7 +94,8 @@ public:
     static VkResult createForImageWithFormat(std::unique_ptr<VulkanImageView>& outPtr,
                                              VkDevice device,
                                              VkImage image,
-                                             VkFormat format) {
+                                             VkFormat format,
+                                             uint32_t mipLevels = 1) {
         VkImageViewCreateInfo viewInfo{};
         viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
         viewInfo.image = image;
@@ -101,7 +103,7 @@ public:
         viewInfo.format = format;
         viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
         viewInfo.subresourceRange.baseMipLevel = 0;
-        viewInfo.subresourceRange.levelCount = 1;
+        viewInfo.subresourceRange.levelCount = mipLevels;
         viewInfo.subresourceRange.baseArrayLayer = 0;
         viewInfo.subresourceRange.layerCount = 1;
         
@@ -145,11 +147,29 @@ VULKAN_DEVICE_CLASS(VulkanFramebuffer, VkFramebuffer, VkFramebufferCreateInfo, v
 VULKAN_DEVICE_CLASS(VulkanCommandPool, VkCommandPool, VkCommandPoolCreateInfo, vkCreateCommandPool, vkDestroyCommandPool)
 };
 
+VULKAN_DEVICE_CLASS(VulkanQueryPool, VkQueryPool, VkQueryPoolCreateInfo, vkCreateQueryPool, vkDestroyQueryPool)
+};
+
 VULKAN_DEVICE_CLASS(VulkanSemaphore, VkSemaphore, VkSemaphoreCreateInfo, vkCreateSemaphore, vkDestroySemaphore)
 public:
     VulkanSemaphore() {
         value_ = VK_NULL_HANDLE;
     }
+    
+    static VkResult createTimeline(std::unique_ptr<VulkanSemaphore>& outPtr,
+                                   VkDevice device,
+                                   uint64_t initialValue = 0) {
+        VkSemaphoreTypeCreateInfo typeInfo{};
+        typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+        typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        typeInfo.initialValue = initialValue;
+        
+        VkSemaphoreCreateInfo semaphoreInfo{};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        semaphoreInfo.pNext = &typeInfo;
+        
+        return VulkanSemaphore::create(outPtr, device, semaphoreInfo);
+    }
 };
 
 VULKAN_DEVICE_CLASS(VulkanFence, VkFence, VkFenceCreateInfo, vkCreateFence, vkDestroyFence)
@@ -185,19 +205,32 @@ public:
         
         return VulkanMemory::create(outPtr, device, allocInfo);
     }
-private:
-    static std::optional<uint32_t> findMemoryType(VkPhysicalDevice physicalDevice, uint32_t typeFilter, VkMemoryPropertyFlags properties){
+    
+    // Among the types having every required property, picks the one with the most preferred properties,
+    // then the one with the fewest properties nobody asked for so e.g. staging doesn't land in device local memory
+    static std::optional<uint32_t> findMemoryType(VkPhysicalDevice physicalDevice,
+                                                  uint32_t typeFilter,
+                                                  VkMemoryPropertyFlags properties,
+                                                  VkMemoryPropertyFlags preferredProperties = 0){
         VkPhysicalDeviceMemoryProperties memoryProperties;
         vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
         
+        std::optional<uint32_t> bestType;
+        int bestScore = 0;
         for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i) {
-            if (typeFilter & (1 << i)
-                && (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties) {
-                return i;
+            VkMemoryPropertyFlags flags = memoryProperties.memoryTypes[i].propertyFlags;
+            if (!(typeFilter & (1 << i)) || (flags & properties) != properties) {
+                continue;
+            }
+            int score = 32 * static_cast<int>(std::bitset<32>(flags & preferredProperties).count())
+                - static_cast<int>(std::bitset<32>(flags & ~(properties | preferredProperties)).count());
+            if (!bestType.has_value() || score > bestScore) {
+                bestType = i;
+                bestScore = score;
             }
         }
         
-        return {};
+        return bestType;
     }
 };
 
@@ -215,15 +248,17 @@ public:
     static VkResult createWithAddressMode(std::unique_ptr<VulkanSampler>& outSampler,
                                           VkSamplerAddressMode addressMode,
                                           VkDevice device,
-                                          VkPhysicalDevice physicalDevice) {
-        return createWithModeAndFilter(outSampler, addressMode, VK_FILTER_LINEAR, device, physicalDevice);
+                                          VkPhysicalDevice physicalDevice,
+                                          float maxLod = VK_LOD_CLAMP_NONE) {
+        return createWithModeAndFilter(outSampler, addressMode, VK_FILTER_LINEAR, device, physicalDevice, maxLod);
     }
 
     static VkResult createWithModeAndFilter(std::unique_ptr<VulkanSampler>& outSampler,
                                             VkSamplerAddressMode addressMode,
                                             VkFilter filter,
                                             VkDevice device,
-                                            VkPhysicalDevice physicalDevice) {
+                                            VkPhysicalDevice physicalDevice,
+                                            float maxLod = VK_LOD_CLAMP_NONE) {
         VkSamplerCreateInfo samplerInfo{};
         samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
         
@@ -256,11 +291,11 @@ public:
         samplerInfo.compareEnable = VK_FALSE;
         samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
         
-        // To be revisted when we implement mip maps
+        // Blend between mip levels, the default maxLod lets the sampler use however many the image view has
         samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
         samplerInfo.mipLodBias = 0.0f;
         samplerInfo.minLod = 0.0f;
-        samplerInfo.maxLod = 0.0f;
+        samplerInfo.maxLod = maxLod;
         
         return VulkanSampler::create(outSampler, device, samplerInfo);
     }
@@ -6,7 +6,13 @@
 #include "VkUtil.h"
 #include "DeviceSelection.h"
 #include "Buffer.h"
+#include "CommandUtil.h"
+#include "SyncPool.h"
+#include "MemoryAllocator.h"
+#include "FrameAllocator.h"
 #include "RenderGraph.h"
+#include "TextureCache.h"
+#include "TextureStreamer.h"
 
 #include <glm/glm.hpp>
 
@@ -68,7 +74,13 @@ private: // Main initialize & run functions
         createRenderPass();
         createFramebuffers();
         createCommandPool();
-        createCommandBuffers();
+        createMemoryAllocator();
+        createFrameAllocator();
+        createSyncPool();
+        createImmediateCommands();
+        createUploadEngine();
+        createTextureCache();
+        createTextureStreamer();
     }
     
     void mainLoop() {
@@ -82,12 +94,10 @@ private: // Main initialize & run functions
     void drawFrame() {
         // Wait for previous frame to complete
         renderGraph_->waitUntilComplete(currentFrameIndex_);
+        frameAllocator_->beginFrame(currentFrameIndex_);
+        textureCache_->beginFrame(currentFrameIndex_);
+        textureStreamer_->update();
         
-        // Perform any pre-draw actions
-        for (auto& callback : preDrawCallbacks_) {
-            (*callback)(*this, currentFrameIndex_);
-        }
-
         // Construct our evaluation context
         RenderEvalContext ctx {
             currentFrameIndex_,
@@ -133,7 +143,8 @@ private: // Vulkan Initialization Functions
         appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
         appInfo.pEngineName = "No Engine";
         appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-        appInfo.apiVersion = VK_API_VERSION_1_0;
+        instanceApiVersion_ = getInstanceApiVersion();
+        appInfo.apiVersion = instanceApiVersion_;
         
         VkInstanceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -174,6 +185,10 @@ private: // Vulkan Initialization Functions
         if (physicalDevice_ == VK_NULL_HANDLE) {
             throw std::runtime_error("Failed to find a suitable GPU.");
         }
+        
+        supportsTimelineSemaphores_ = checkTimelineSemaphoreSupport(physicalDevice_, instanceApiVersion_);
+        supportsMemoryBudget_ = checkMemoryBudgetSupport(physicalDevice_, instanceApiVersion_);
+        supportsExternalMemoryHost_ = checkExternalMemoryHostSupport(physicalDevice_, instanceApiVersion_);
     }
     
     void createLogicalDevice() {
@@ -194,25 +209,43 @@ private: // Vulkan Initialization Functions
         
         VkPhysicalDeviceFeatures deviceFeatures{}; // empty for now;
         
+        // Opt in to timeline semaphores for the render graph when available
+        VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures{};
+        timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+        timelineFeatures.timelineSemaphore = VK_TRUE;
+        
         VkDeviceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+        createInfo.pNext = supportsTimelineSemaphores_ ? &timelineFeatures : nullptr;
         
         createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
         createInfo.pQueueCreateInfos = queueCreateInfos.data();
         createInfo.pEnabledFeatures = &deviceFeatures;
         
         createInfo.enabledLayerCount = 0;
-        createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-        createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+        // Budget queries are optional, allocations are tracked either way
+        std::vector<const char*> enabledExtensions = deviceExtensions;
+        if (supportsMemoryBudget_) {
+            enabledExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+        }
+        // Lets uploads read host allocations in place, they are staged otherwise
+        if (supportsExternalMemoryHost_) {
+            enabledExtensions.push_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+        }
+        createInfo.enabledExtensionCount = static_cast<uint32_t>(enabledExtensions.size());
+        createInfo.ppEnabledExtensionNames = enabledExtensions.data();
         
         VK_SUCCESS_OR_THROW(VulkanDevice::create(device_, physicalDevice_, createInfo),
                             "Failed to create logical device.");
         
         vkGetDeviceQueue(**device_, indices.graphicsFamily.value(), 0, &graphicsQueue_);
         vkGetDeviceQueue(**device_, indices.presentFamily.value(), 0, &presentQueue_);
-        // Compute queue technically same as graphics in current implementation
-        // Creating dedicated handle in case I ever actually implement the async queue
-        vkGetDeviceQueue(**device_, indices.graphicsFamily.value(), 0, &computeQueue_);
+        // Separate family when the device has one, the render graph moves ownership between them
+        vkGetDeviceQueue(**device_, indices.computeFamily.value(), 0, &computeQueue_);
+        vkGetDeviceQueue(**device_, indices.transferFamily.value(), 0, &transferQueue_);
+        graphicsQueueFamily_ = indices.graphicsFamily.value();
+        computeQueueFamily_ = indices.computeFamily.value();
+        transferQueueFamily_ = indices.transferFamily.value();
     }
     
     void createSwapChain() {
@@ -363,17 +396,46 @@ private: // Vulkan Initialization Functions
                             "Failed to create command pool");
     }
     
-    void createCommandBuffers() {
-        VkCommandBufferAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        allocInfo.commandPool = **commandPool_;
-        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocInfo.commandBufferCount = MAX_FRAMES;
-        
-        VK_SUCCESS_OR_THROW(vkAllocateCommandBuffers(**device_, &allocInfo, commandBuffers_.data()),
-                            "Failed to allocate command buffers");
-        VK_SUCCESS_OR_THROW(vkAllocateCommandBuffers(**device_, &allocInfo, computeCommandBuffers_.data()),
-                            "Failed to allocate command buffers");
+    void createMemoryAllocator() {
+        memoryBudget_ = std::make_unique<MemoryBudget>(physicalDevice_, supportsMemoryBudget_);
+        memoryAllocator_ = std::make_unique<MemoryAllocator>(**device_, physicalDevice_, *memoryBudget_);
+    }
+    
+    void createFrameAllocator() {
+        frameAllocator_ = std::make_unique<FrameAllocator<MAX_FRAMES>>(**device_, physicalDevice_, *memoryAllocator_);
+    }
+    
+    void createSyncPool() {
+        syncPool_ = std::make_unique<SyncPool>(**device_);
+    }
+    
+    void createImmediateCommands() {
+        immediateCommands_ = std::make_unique<ImmediateCommands>(**device_, *syncPool_, graphicsQueue_, graphicsQueueFamily_);
+    }
+    
+    void createUploadEngine() {
+        hostMemoryImporter_ = std::make_unique<HostMemoryImporter>(**device_, physicalDevice_, *memoryBudget_, supportsExternalMemoryHost_);
+        // Uploaded resources end up owned by the graphics family
+        uploadEngine_ = std::make_unique<UploadEngine>(**device_,
+                                                       physicalDevice_,
+                                                       *memoryAllocator_,
+                                                       *syncPool_,
+                                                       transferQueue_,
+                                                       transferQueueFamily_,
+                                                       graphicsQueue_,
+                                                       graphicsQueueFamily_,
+                                                       hostMemoryImporter_.get());
+    }
+    
+    void createTextureCache() {
+        textureCache_ = std::make_unique<TextureCache<MAX_FRAMES>>(**device_, *memoryAllocator_, *uploadEngine_);
+    }
+    
+    void createTextureStreamer() {
+        textureStreamer_ = std::make_unique<TextureStreamer<MAX_FRAMES>>(**device_,
+                                                                         *memoryAllocator_,
+                                                                         *uploadEngine_,
+                                                                         hostMemoryImporter_.get());
     }
     
 private: // Additional helper functions
@@ -409,12 +471,6 @@ private: // Additional helper functions
     }
     
 public:
-    // TODO: Replace with CPU render graph nodes
-    // Add callback to be called before drawing each frame
-    void addPreDrawCallback(std::shared_ptr<std::function<void(VulkanApp&, uint32_t)>>& callback) {
-        preDrawCallbacks_.push_back(callback);
-    }
-    
     void setRenderGraph(std::unique_ptr<RenderGraph<MAX_FRAMES>>&& renderGraph) {
         renderGraph_ = std::move(renderGraph);
     }
@@ -428,10 +484,53 @@ public: // Public getters
         return physicalDevice_;
     }
     
+    bool supportsTimelineSemaphores() {
+        return supportsTimelineSemaphores_;
+    }
+    
     VkCommandPool getCommandPool() {
         return **commandPool_;
     }
     
+    MemoryBudget& getMemoryBudget() {
+        return *memoryBudget_;
+    }
+    
+    MemoryAllocator& getMemoryAllocator() {
+        return *memoryAllocator_;
+    }
+    
+    FrameAllocator<MAX_FRAMES>& getFrameAllocator() {
+        return *frameAllocator_;
+    }
+    
+    SyncPool& getSyncPool() {
+        return *syncPool_;
+    }
+    
+    ImmediateCommands& getImmediateCommands() {
+        return *immediateCommands_;
+    }
+    
+    UploadEngine& getUploadEngine() {
+        return *uploadEngine_;
+    }
+    
+    // Tells how host allocations have to be laid out to be uploaded without staging
+    HostMemoryImporter& getHostMemoryImporter() {
+        return *hostMemoryImporter_;
+    }
+    
+    // Load textures through here so materials sharing one share the image
+    TextureCache<MAX_FRAMES>& getTextureCache() {
+        return *textureCache_;
+    }
+    
+    // Textures requested here are swapped in as they finish loading, between frames
+    TextureStreamer<MAX_FRAMES>& getTextureStreamer() {
+        return *textureStreamer_;
+    }
+    
     VkQueue getGraphicsQueue() {
         return graphicsQueue_;
     }
@@ -443,6 +542,14 @@ public: // Public getters
     VkQueue getPresentQueue() {
         return presentQueue_;
     }
+    
+    uint32_t getGraphicsQueueFamily() {
+        return graphicsQueueFamily_;
+    }
+    
+    uint32_t getComputeQueueFamily() {
+        return computeQueueFamily_;
+    }
 
     VkExtent2D getSwapchainExtent() {
         return swapChainExtent_;
@@ -455,14 +562,6 @@ public: // Public getters
     VkSwapchainKHR getSwapchain() {
         return **swapChain_;
     }
-    
-    std::array<VkCommandBuffer, MAX_FRAMES> getGraphicsCommandBuffers() {
-        return commandBuffers_;
-    }
-    
-    std::array<VkCommandBuffer, MAX_FRAMES> getComputeCommandBuffers() {
-        return computeCommandBuffers_;
-    }
 private: // Member variables
     // Application constants
     const uint32_t windowHeight_;
@@ -476,11 +575,20 @@ private: // Member variables
     std::unique_ptr<VulkanInstance> instance_;
     VkPhysicalDevice physicalDevice_ = VK_NULL_HANDLE;
     std::unique_ptr<VulkanDevice> device_;
+    // Version the instance was created with, the device is used at no more than that
+    uint32_t instanceApiVersion_ = VK_API_VERSION_1_0;
+    bool supportsTimelineSemaphores_ = false;
+    bool supportsMemoryBudget_ = false;
+    bool supportsExternalMemoryHost_ = false;
     
     // Hardware Queues
     VkQueue graphicsQueue_;
     VkQueue presentQueue_;
     VkQueue computeQueue_;
+    VkQueue transferQueue_;
+    uint32_t graphicsQueueFamily_;
+    uint32_t computeQueueFamily_;
+    uint32_t transferQueueFamily_;
     
     // Surface & Swapchain
     std::unique_ptr<VulkanSurface> surface_;
@@ -502,12 +610,35 @@ private: // Member variables
     // TODO: Can be owned here but need to match what is needed
     std::unique_ptr<VulkanCommandPool> commandPool_;
     
+    // Tracks device memory against the heaps' budgets
+    std::unique_ptr<MemoryBudget> memoryBudget_;
+    
+    // Sub-allocates device memory for buffers & images, must outlive everything bound to it
+    std::unique_ptr<MemoryAllocator> memoryAllocator_;
+    
+    // Per-frame uniform data, reset once the frame's previous submission completes
+    std::unique_ptr<FrameAllocator<MAX_FRAMES>> frameAllocator_;
+    
+    // Recycled fences, semaphores & command buffers, must outlive everything holding a lease
+    std::unique_ptr<SyncPool> syncPool_;
+    
+    // Batched one-off commands on the graphics queue
+    std::unique_ptr<ImmediateCommands> immediateCommands_;
+    
+    // Imports host allocations for the upload engine, outlives it
+    std::unique_ptr<HostMemoryImporter> hostMemoryImporter_;
+    
+    // Batched resource uploads on the transfer queue
+    std::unique_ptr<UploadEngine> uploadEngine_;
+    
+    // Shares textures loaded from disk and evicts the unused ones past its cap
+    std::unique_ptr<TextureCache<MAX_FRAMES>> textureCache_;
+    
+    // Decodes textures in the background and uploads them through the upload engine
+    std::unique_ptr<TextureStreamer<MAX_FRAMES>> textureStreamer_;
+    
     // Current frame index
     uint32_t currentFrameIndex_ = 0;
     
-    std::array<VkCommandBuffer, MAX_FRAMES> commandBuffers_;
-    std::array<VkCommandBuffer, MAX_FRAMES> computeCommandBuffers_;
-    
-    std::vector<std::shared_ptr<std::function<void(VulkanApp&,uint32_t)>>> preDrawCallbacks_{};
     std::unique_ptr<RenderGraph<MAX_FRAMES>> renderGraph_{};
 };
@@ -11,10 +11,15 @@
 #include "AcquireImageNode.h"
 #include "FileUtil.h"
 #include "Image.h"
+#include "StbAllocator.h"
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+// Decoded pixels can then be imported by the upload engine instead of staged
+#define STBI_MALLOC(size) StbAllocator::allocate(size)
+#define STBI_REALLOC(pointer, size) StbAllocator::reallocate(pointer, size)
+#define STBI_FREE(pointer) StbAllocator::release(pointer)
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
@@ -62,6 +67,7 @@ class TutorialMaterial : public BasicMaterial<MAX_FRAMES_IN_FLIGHT, 3> {
 public:
     TutorialMaterial(VkDevice device,
                      VkPhysicalDevice physicalDevice,
+                     FrameAllocator<MAX_FRAMES_IN_FLIGHT>& frameAllocator,
                      VkExtent2D swapchainExtent,
                      VkRenderPass renderPass,
                      std::vector<std::shared_ptr<Descriptor>> descriptors,
@@ -75,24 +81,8 @@ public:
                                               vertSpirv,
                                               fragSpirv,
                                               Vertex::getBindingDescription(),
-                                              Vertex::getAttributeDescriptions()){
-        // JANK: Find the first uniform buffer object descriptor
-        using UboDesc = UniformBufferDescriptor<UniformBufferObject, MAX_FRAMES_IN_FLIGHT>;
-        std::shared_ptr<UboDesc> uboDesc = nullptr;
-        for (auto& descriptor : Material<MAX_FRAMES_IN_FLIGHT>::descriptors_) {
-            if (descriptor->getType() == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
-                uboDesc = std::reinterpret_pointer_cast<UboDesc>(descriptor);
-                break;
-            }
-        }
-        
-        // Create & bind our uniform buffers
-        for (uint frameIdx = 0; frameIdx < MAX_FRAMES_IN_FLIGHT; ++frameIdx) {
-            createUniformBuffer(frameIdx);
-            uboDesc->bindBuffer(frameIdx, uniformBuffers_.at(frameIdx)->getBuffer());
-            populateDescriptorSet(frameIdx);
-        }
-    }
+                                              Vertex::getAttributeDescriptions()),
+    frameAllocator_(frameAllocator) {}
     
     void update(uint32_t currentImage, VkExtent2D swapChainExtent) {
         static auto startTime = std::chrono::high_resolution_clock::now();
@@ -110,22 +100,11 @@ public:
 
         auto ubo = UniformBufferObject::fromModelViewProjection(model, view, projection);
         
-        memcpy(mappedUniformBuffers_[currentImage].get(), &ubo, sizeof(ubo));
-    }
-private:
-    void createUniformBuffer(uint32_t frameIndex) {
-        VK_SUCCESS_OR_THROW(Buffer<UniformBufferObject>::create(uniformBuffers_[frameIndex],
-                                                                1,
-                                                                VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                                                                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
-                                                                device_,
-                                                                physicalDevice_),
-                            "Failed to create uniform buffer.");
-        mappedUniformBuffers_[frameIndex] = uniformBuffers_[frameIndex]->getPersistentMapping(0, sizeof(UniformBufferObject));
+        // The ubo is the only dynamic descriptor, so it takes the first offset
+        dynamicOffsets_[currentImage][0] = frameAllocator_.push(currentImage, ubo).offset;
     }
 private:
-    std::array<std::unique_ptr<Buffer<UniformBufferObject>>, MAX_FRAMES_IN_FLIGHT> uniformBuffers_;
-    std::array<std::unique_ptr<UniformBufferObject, std::function<void(UniformBufferObject*)>>, MAX_FRAMES_IN_FLIGHT> mappedUniformBuffers_;
+    FrameAllocator<MAX_FRAMES_IN_FLIGHT>& frameAllocator_;
 };
 
 class TestComputeMat : public ComputeMaterial<MAX_FRAMES_IN_FLIGHT> {
@@ -166,15 +145,18 @@ const std::vector<uint16_t> indexData = {
 
 void createTestComputeMaterial(std::unique_ptr<TestComputeMat>& outPtr,
                                std::array<VkImageView, MAX_FRAMES_IN_FLIGHT> inViews,
-                               std::array<VkImageView, MAX_FRAMES_IN_FLIGHT> outViews,
+                               VkImageLayout inLayout,
+                               std::shared_ptr<StorageImageDescriptor<MAX_FRAMES_IN_FLIGHT>> outDescriptor,
                                uint32_t width, uint32_t height,
                                VulkanApp<MAX_FRAMES_IN_FLIGHT>& app){
     const static std::string shaderPath = "/Users/zyoussef/code/vulkan_test/vulkan_test/shaders";
     auto computeShaderCode = readFile(shaderPath + "/compTest.spv");
     
     std::vector<std::shared_ptr<Descriptor>> descriptors;
-    descriptors.push_back(std::make_shared<StorageImageDescriptor<MAX_FRAMES_IN_FLIGHT>>(VK_SHADER_STAGE_COMPUTE_BIT, inViews));
-    descriptors.push_back(std::make_shared<StorageImageDescriptor<MAX_FRAMES_IN_FLIGHT>>(VK_SHADER_STAGE_COMPUTE_BIT, outViews));
+    descriptors.push_back(std::make_shared<StorageImageDescriptor<MAX_FRAMES_IN_FLIGHT>>(VK_SHADER_STAGE_COMPUTE_BIT,
+                                                                                         inViews,
+                                                                                         inLayout));
+    descriptors.push_back(outDescriptor);
 
     outPtr = std::make_unique<TestComputeMat>(computeShaderCode,
                                               descriptors,
@@ -184,20 +166,20 @@ void createTestComputeMaterial(std::unique_ptr<TestComputeMat>& outPtr,
 }
 
 void createTutorialMaterial(std::unique_ptr<TutorialMaterial>& outPtr,
-                            std::array<VkImageView, MAX_FRAMES_IN_FLIGHT> imageViews,
-                            VkSampler sampler,
+                            std::shared_ptr<CombinedImageSamplerDescriptor<MAX_FRAMES_IN_FLIGHT>> textureDescriptor,
                             VulkanApp<MAX_FRAMES_IN_FLIGHT>& app) {
     const static std::string shaderPath = "/Users/zyoussef/code/vulkan_test/vulkan_test/shaders";
     auto vertShaderCode = readFile(shaderPath + "/vert.spv");
     auto fragShaderCode = readFile(shaderPath + "/frag.spv");
     
     std::vector<std::shared_ptr<Descriptor>> descriptors;
-    descriptors.push_back(std::make_shared<UniformBufferDescriptor<UniformBufferObject, MAX_FRAMES_IN_FLIGHT>>(std::array<VkBuffer, MAX_FRAMES_IN_FLIGHT>{},
-                                                                                                               VK_SHADER_STAGE_VERTEX_BIT));
-    descriptors.push_back(std::make_shared<CombinedImageSamplerDescriptor<MAX_FRAMES_IN_FLIGHT>>(VK_SHADER_STAGE_FRAGMENT_BIT, imageViews, sampler));
+    descriptors.push_back(std::make_shared<DynamicUniformBufferDescriptor<UniformBufferObject, MAX_FRAMES_IN_FLIGHT>>(app.getFrameAllocator().getBuffer(),
+                                                                                                                      VK_SHADER_STAGE_VERTEX_BIT));
+    descriptors.push_back(textureDescriptor);
 
     outPtr = std::make_unique<TutorialMaterial>(app.getDevice(),
                                                 app.getPhysicalDevice(),
+                                                app.getFrameAllocator(),
                                                 app.getSwapchainExtent(),
                                                 app.getRenderPass(),
                                                 descriptors,
@@ -206,18 +188,16 @@ void createTutorialMaterial(std::unique_ptr<TutorialMaterial>& outPtr,
 }
 
 void createTutorialRenderable(std::unique_ptr<MeshRenderable<Vertex, MAX_FRAMES_IN_FLIGHT>>& outPtr,
-                              std::array<VkImageView, MAX_FRAMES_IN_FLIGHT> textureImages,
-                              VkSampler textureSampler,
+                              std::shared_ptr<CombinedImageSamplerDescriptor<MAX_FRAMES_IN_FLIGHT>> textureDescriptor,
                               VulkanApp<MAX_FRAMES_IN_FLIGHT>& app) {
     std::unique_ptr<TutorialMaterial> material;
-    createTutorialMaterial(material, textureImages, textureSampler, app);
+    createTutorialMaterial(material, textureDescriptor, app);
     
     outPtr = std::make_unique<MeshRenderable<Vertex, MAX_FRAMES_IN_FLIGHT>>(vertexData, indexData,
                                                                             std::move(material),
                                                                             app.getDevice(),
-                                                                            app.getPhysicalDevice(),
-                                                                            app.getGraphicsQueue(),
-                                                                            app.getCommandPool());
+                                                                            app.getMemoryAllocator(),
+                                                                            app.getUploadEngine());
 }
 
 int main() {
@@ -226,29 +206,27 @@ int main() {
     // Initialize Window & Vulkan
     app.init();
     
-    // Load texture file
+    // Load texture file, the compute pass reads it from the compute queue.
+    // It is read as a storage image, which has to be in the general layout, so it gets its own image
+    // rather than a cached one other users expect to be shader read-only.
     std::unique_ptr<Image> texture;
     Image::createFromFile(texture,
                           "/Users/zyoussef/code/vulkan_test/vulkan_test/textures/texture.jpg",
-                          app.getGraphicsQueue(),
-                          app.getCommandPool(),
+                          app.getUploadEngine(),
                           app.getDevice(),
-                          app.getPhysicalDevice());
+                          app.getMemoryAllocator(),
+                          {app.getGraphicsQueueFamily(), app.getComputeQueueFamily()});
+    app.getImmediateCommands().record([&](VkCommandBuffer commandBuffer){
+        texture->transitionTo(commandBuffer, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+    });
     std::array<VkImageView, MAX_FRAMES_IN_FLIGHT> inputImages = {texture->getImageView(), texture->getImageView()};
 
-    // Create output texture images
-    std::array<std::unique_ptr<Image>, MAX_FRAMES_IN_FLIGHT> outImages;
-    for (int frameIdx = 0; frameIdx < MAX_FRAMES_IN_FLIGHT; ++frameIdx) {
-        Image::createEmptyRGBA(outImages[frameIdx],
-                               texture->getWidth(),
-                               texture->getHeight(),
-                               app.getGraphicsQueue(),
-                               app.getCommandPool(),
-                               app.getDevice(),
-                               app.getPhysicalDevice());
-    }
-    
-    std::array<VkImageView, MAX_FRAMES_IN_FLIGHT> outputImages = {outImages[0]->getImageView(), outImages[1]->getImageView()};
+    // Instantiate our render graph
+    auto syncBackend = app.supportsTimelineSemaphores() ? SyncBackend::TIMELINE : SyncBackend::BINARY;
+    std::unique_ptr<RenderGraph<MAX_FRAMES_IN_FLIGHT>> renderGraph = std::make_unique<RenderGraph<MAX_FRAMES_IN_FLIGHT>>(app.getDevice(),
+                                                                                                                         app.getPhysicalDevice(),
+                                                                                                                         syncBackend,
+                                                                                                                         &app.getMemoryBudget());
 
     // Create texture sampler
     std::unique_ptr<VulkanSampler> sampler;
@@ -257,35 +235,45 @@ int main() {
                                          app.getDevice(),
                                          app.getPhysicalDevice());
     
+    // The compute output only lives within a frame, so let the graph own it
+    auto outImage = renderGraph->createTransientImage({texture->getWidth(),
+                                                       texture->getHeight(),
+                                                       VK_FORMAT_R8G8B8A8_SRGB,
+                                                       VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT});
+    auto outImageStorage = std::make_shared<StorageImageDescriptor<MAX_FRAMES_IN_FLIGHT>>(VK_SHADER_STAGE_COMPUTE_BIT,
+                                                                                          std::array<VkImageView, MAX_FRAMES_IN_FLIGHT>{});
+    auto outImageSampled = std::make_shared<CombinedImageSamplerDescriptor<MAX_FRAMES_IN_FLIGHT>>(VK_SHADER_STAGE_FRAGMENT_BIT,
+                                                                                                  std::array<VkImageView, MAX_FRAMES_IN_FLIGHT>{},
+                                                                                                  **sampler);
+    renderGraph->bindImageDescriptor(outImage, outImageStorage);
+    renderGraph->bindImageDescriptor(outImage, outImageSampled);
 
     // Create renderable
     std::unique_ptr<MeshRenderable<Vertex, MAX_FRAMES_IN_FLIGHT>> renderable;
-    createTutorialRenderable(renderable, outputImages, **sampler, app);
+    createTutorialRenderable(renderable, outImageSampled, app);
     
     
     // Create compute material
     std::unique_ptr<TestComputeMat> computeMaterial;
     createTestComputeMaterial(computeMaterial,
                               inputImages,
-                              outputImages,
+                              texture->getLayout(),
+                              outImageStorage,
                               texture->getWidth(),
                               texture->getHeight(),
                               app);
     
-    // Instantiate our render graph
-    std::unique_ptr<RenderGraph<MAX_FRAMES_IN_FLIGHT>> renderGraph = std::make_unique<RenderGraph<MAX_FRAMES_IN_FLIGHT>>(app.getDevice());
-    
     // Add Nodes
     auto acquireImageNode = renderGraph->addNode(std::make_unique<AcquireImageNode<MAX_FRAMES_IN_FLIGHT>>(app.getDevice()));
     auto computeNode = renderGraph->addNode(std::make_unique<ComputeNode<MAX_FRAMES_IN_FLIGHT>>(std::move(computeMaterial),
                                                                                                app.getDevice(),
                                                                                                app.getComputeQueue(),
-                                                                                               app.getComputeCommandBuffers()));
+                                                                                               app.getComputeQueueFamily()));
     auto graphicsNode = renderGraph->addNode(std::make_unique<RenderableNode<MAX_FRAMES_IN_FLIGHT>>(std::move(renderable),
                                                                                                     app.getDevice(),
                                                                                                     app.getGraphicsQueue(),
-                                                                                                    app.getRenderPass(),
-                                                                                                    app.getGraphicsCommandBuffers()));
+                                                                                                    app.getGraphicsQueueFamily(),
+                                                                                                    app.getRenderPass()));
     auto presentNode = renderGraph->addNode(std::make_unique<PresentNode<MAX_FRAMES_IN_FLIGHT>>(app.getDevice(),
                                                                                                 app.getPresentQueue()));
     
@@ -294,7 +282,17 @@ int main() {
     renderGraph->addEdge(computeNode, graphicsNode);
     renderGraph->addEdge(graphicsNode, presentNode);
     renderGraph->flagNodeAsFrameBlocking(graphicsNode);
+    
+    // Declare transient resource usage
+    renderGraph->addResourceUse(computeNode, outImage, STORAGE_WRITE, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    renderGraph->addResourceUse(graphicsNode, outImage, SAMPLED_READ, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
 
+    // Push every upload and one-off command out in one batch each and let them land before the first frame
+    auto& uploadEngine = app.getUploadEngine();
+    uploadEngine.wait(uploadEngine.flush());
+    auto& immediateCommands = app.getImmediateCommands();
+    immediateCommands.wait(immediateCommands.flush());
+    
     // Set on app
     app.setRenderGraph(std::move(renderGraph));
 